@@ -33,6 +33,11 @@
     <!--<param name="tsl.cache" lock="false"></param>-->
     <!--<param name="tsl.onlineDigest" lock="false">true</param>-->
     <!--<param name="tsl.timeOut" lock="false">10</param>-->
+    <!--<param name="tsl.refreshInterval" lock="false">0</param>-->
+
+    <!--ZIP container settings-->
+    <!--<param name="zip.compressionLevel" lock="false">-1</param>-->
+    <!--<param name="zip.threads" lock="false">0</param>-->
 
     <!--Verify service settings-->
     <!--<param name="verify.serivceUri" lock="false">@SIVA_URL@</param>-->
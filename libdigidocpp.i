@@ -194,6 +194,10 @@ extern "C"
 // unique_ptr: There is no special smart pointer handling available for std::weak_ptr and std::unique_ptr yet.
 %ignore digidoc::Container::createPtr;
 %ignore digidoc::Container::openPtr;
+%ignore digidoc::Signature::Validator::validateAll;
+// std::future: no usable wrappers, asynchronous methods are for C++ API
+%ignore digidoc::Container::signAsync;
+%ignore digidoc::Signature::extendSignatureProfileAsync;
 
 %newobject digidoc::Container::open;
 %newobject digidoc::Container::create;
@@ -32,8 +32,12 @@
 
 #include <xercesc/util/OutOfMemoryException.hpp>
 
+#include <atomic>
 #include <fstream>
+#include <future>
+#include <map>
 #include <set>
+#include <thread>
 
 using namespace digidoc;
 using namespace digidoc::util;
@@ -51,7 +55,16 @@ const string ASiC_E::MANIFEST_NAMESPACE = "urn:oasis:names:tc:opendocument:xmlns
 class ASiC_E::Private
 {
 public:
+    struct SignatureFile { string name; vector<unsigned char> digest; };
+    static vector<unsigned char> digest(const string &data)
+    {
+        Digest calc(URI_SHA256);
+        calc.update((const unsigned char*)data.c_str(), data.size());
+        return calc.result();
+    }
+
     vector<DataFile*> metadata;
+    map<const Signature*,SignatureFile> signatureFiles;
 };
 
 /**
@@ -70,8 +83,7 @@ ASiC_E::ASiC_E(const string &path)
     : ASiContainer(MIMETYPE_ASIC_E)
     , d(new Private)
 {
-    auto zip = load(path, true, {MIMETYPE_ASIC_E, MIMETYPE_ADOC});
-    parseManifestAndLoadFiles(*zip);
+    parseManifestAndLoadFiles(load(path, true, {MIMETYPE_ASIC_E, MIMETYPE_ADOC}));
 }
 
 ASiC_E::~ASiC_E()
@@ -102,29 +114,162 @@ void ASiC_E::save(const string &path)
 
     if(!path.empty())
         zpath(path);
-    ZipSerialize s(zpath(), true);
+    if(appendSignatures())
+        return;
 
-    stringstream mimetype;
-    mimetype << mediaType();
-    s.addFile("mimetype", mimetype, zproperty("mimetype"), ZipSerialize::DontCompress);
+    string target = zwritePath();
+    map<const Signature*,Private::SignatureFile> signatureFiles;
+    try
+    {
+        ZipSerialize s(target, true);
 
-    stringstream manifest;
-    createManifest(manifest);
-    s.addFile("META-INF/manifest.xml", manifest, zproperty("META-INF/manifest.xml"));
+        stringstream mimetype;
+        mimetype << mediaType();
+        s.addFile("mimetype", mimetype, zproperty("mimetype"), ZipSerialize::DontCompress);
 
-    for(const DataFile *file: dataFiles())
-        s.addFile(file->fileName(), *(static_cast<const DataFilePrivate*>(file)->m_is.get()), zproperty(file->fileName()));
+        stringstream manifest;
+        createManifest(manifest);
+        s.addFile("META-INF/manifest.xml", manifest, zproperty("META-INF/manifest.xml"));
 
-    unsigned int i = 0;
-    for(Signature *iter: signatures())
+        for(const DataFile *file: dataFiles())
+            s.addFile(file->fileName(), *(static_cast<const DataFilePrivate*>(file)->m_is.get()), zproperty(file->fileName()));
+
+        unsigned int i = 0;
+        for(Signature *iter: signatures())
+        {
+            string file = Log::format("META-INF/signatures%u.xml", i++);
+            SignatureXAdES_B *signature = static_cast<SignatureXAdES_B*>(iter);
+
+            stringstream ofs;
+            signature->saveToXml(ofs);
+            s.addFile(file, ofs, zproperty(file));
+            signatureFiles[signature] = { file, Private::digest(ofs.str()) };
+        }
+    }
+    catch(const Exception &)
+    {
+        if(target != zpath())
+            File::removeFile(target);
+        throw;
+    }
+    zcommit(target);
+    d->signatureFiles.swap(signatureFiles);
+}
+
+/**
+ * Parses signature files on a pool of worker threads, each parse is an independent
+ * schema validation and XML binding. Signatures are added in the order of <code>files</code>.
+ *
+ * @throws Exception containing parse error of every failed signature file.
+ */
+void ASiC_E::parseSignatures(const ZipSerialize &z, const vector<string> &files)
+{
+    struct Result
+    {
+        unique_ptr<SignatureXAdES_LTA> signature;
+        vector<unsigned char> digest;
+        unique_ptr<Exception> error;
+    };
+    vector<Result> results(files.size());
+    atomic<size_t> next(0);
+    auto worker = [&] {
+        for(size_t i = next++; i < files.size(); i = next++)
+        {
+            try
+            {
+                stringstream data;
+                z.extract(files[i], data);
+                results[i].digest = Private::digest(data.str());
+                results[i].signature.reset(new SignatureXAdES_LTA(data, this, true));
+            }
+            catch(const Exception &e)
+            {
+                results[i].error.reset(new Exception(EXCEPTION_PARAMS("Failed to parse signature '%s'.", files[i].c_str()), e));
+            }
+        }
+    };
+
+    unsigned int threads = min<unsigned int>(max(thread::hardware_concurrency(), 1U), unsigned(files.size()));
+    DEBUG("ASiC_E::parseSignatures(signatures = %lu, threads = %u)", (unsigned long)files.size(), threads);
+    vector<future<void>> workers;
+    for(unsigned int i = 1; i < threads; ++i)
+        workers.push_back(async(launch::async, worker));
+    worker();
+    for(future<void> &f: workers)
+        f.get();
+
+    vector<Exception> errors;
+    for(Result &result: results)
     {
-        string file = Log::format("META-INF/signatures%u.xml", i++);
-        SignatureXAdES_B *signature = static_cast<SignatureXAdES_B*>(iter);
+        if(result.error)
+            errors.push_back(*result.error);
+    }
+    if(errors.size() == 1)
+        throw errors.front();
+    if(!errors.empty())
+    {
+        Exception e(EXCEPTION_PARAMS("Failed to parse %lu signatures.", (unsigned long)errors.size()));
+        for(const Exception &error: errors)
+            e.addCause(error);
+        throw e;
+    }
 
+    for(size_t i = 0; i < files.size(); ++i)
+    {
+        SignatureXAdES_LTA *signature = results[i].signature.release();
+        addSignature(signature);
+        d->signatureFiles[signature] = { files[i], results[i].digest };
+    }
+}
+
+/**
+ * Adds new signatures to the end of the container archive without recompressing documents
+ * and existing signatures. New signatures are written in place over the central directory,
+ * which is backed up beforehand and restored when the save fails, so that a failed save
+ * does not corrupt the container.
+ *
+ * @return returns false when archive has to be rewritten, e.g. documents or existing
+ *         signatures were modified or removed or container is saved to a new file.
+ */
+bool ASiC_E::appendSignatures()
+{
+    vector<pair<const Signature*,string>> added;
+    size_t unchanged = 0;
+    for(const Signature *iter: signatures())
+    {
         stringstream ofs;
-        signature->saveToXml(ofs);
-        s.addFile(file, ofs, zproperty(file));
+        static_cast<const SignatureXAdES_B*>(iter)->saveToXml(ofs);
+        map<const Signature*,Private::SignatureFile>::const_iterator i = d->signatureFiles.find(iter);
+        if(i == d->signatureFiles.cend())
+            added.push_back({ iter, ofs.str() });
+        else if(i->second.digest == Private::digest(ofs.str()))
+            ++unchanged;
+        else
+            return false;
+    }
+    if(unchanged != d->signatureFiles.size() || !zcanAppend())
+        return false;
+    if(added.empty())
+        return true;
+
+    DEBUG("ASiC_E::appendSignatures(%lu)", (unsigned long)added.size());
+    map<const Signature*,Private::SignatureFile> signatureFiles = d->signatureFiles;
+    unique_ptr<ZipSerialize> s = zappend();
+    unsigned int i = 0;
+    for(const pair<const Signature*,string> &signature: added)
+    {
+        string file;
+        do file = Log::format("META-INF/signatures%u.xml", i++);
+        while(any_of(signatureFiles.cbegin(), signatureFiles.cend(),
+            [&](const pair<const Signature*,Private::SignatureFile> &f) { return f.second.name == file; }));
+
+        stringstream ofs(signature.second);
+        s->addFile(file, ofs, zproperty(file));
+        signatureFiles[signature.first] = { file, Private::digest(signature.second) };
     }
+    s->save();
+    d->signatureFiles.swap(signatureFiles);
+    return true;
 }
 
 unique_ptr<Container> ASiC_E::createInternal(const string &path)
@@ -274,6 +419,7 @@ void ASiC_E::parseManifestAndLoadFiles(const ZipSerialize &z)
         if(!mimeFound)
             THROW("Manifest is missing mediatype file entry.");
 
+        vector<string> signatureFiles;
         for(const string &file: list)
         {
             /**
@@ -286,16 +432,7 @@ void ASiC_E::parseManifestAndLoadFiles(const ZipSerialize &z)
             {
                 if(count(list.begin(), list.end(), file) > 1)
                     THROW("Multiple signature files with same name found '%s'", file.c_str());
-                try
-                {
-                    stringstream data;
-                    z.extract(file, data);
-                    addSignature(new SignatureXAdES_LTA(data, this, true));
-                }
-                catch(const Exception &e)
-                {
-                    THROW_CAUSE(e, "Failed to parse signature '%s'.", file.c_str());
-                }
+                signatureFiles.push_back(file);
                 continue;
             }
 
@@ -304,6 +441,7 @@ void ASiC_E::parseManifestAndLoadFiles(const ZipSerialize &z)
             if(manifestFiles.find(file) == manifestFiles.end())
                 THROW("File '%s' found in container is not described in manifest.", file.c_str());
         }
+        parseSignatures(z, signatureFiles);
     }
     catch(const xercesc::DOMException &e)
     {
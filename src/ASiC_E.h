@@ -59,8 +59,10 @@ namespace digidoc
           ASiC_E();
           ASiC_E(const std::string &path);
           DISABLE_COPY(ASiC_E);
+          bool appendSignatures();
           void createManifest(std::ostream &os);
           void parseManifestAndLoadFiles(const ZipSerialize &z);
+          void parseSignatures(const ZipSerialize &z, const std::vector<std::string> &files);
 
           class Private;
           Private *d;
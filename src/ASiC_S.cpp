@@ -45,8 +45,7 @@ ASiC_S::ASiC_S(): ASiContainer(MIMETYPE_ASIC_S)
  */
 ASiC_S::ASiC_S(const string &path): ASiContainer(MIMETYPE_ASIC_S)
 {
-    auto z = load(path, false, {MIMETYPE_ASIC_S});
-    loadContainer(*z);
+    loadContainer(load(path, false, {MIMETYPE_ASIC_S}));
 }
 
 void ASiC_S::save(const string & /*path*/)
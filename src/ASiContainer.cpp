@@ -41,10 +41,12 @@ using namespace std;
 class ASiContainer::Private
 {
 public:
-    string mimetype, path;
+    string mimetype, path, zipPath;
     vector<DataFile*> documents;
     vector<Signature*> signatures;
     map<string, ZipSerialize::Properties> properties;
+    unique_ptr<ZipSerialize> zip;
+    bool documentsChanged = false;
 };
 
 const string ASiContainer::ASICE_EXTENSION = "asice";
@@ -73,12 +75,13 @@ ASiContainer::ASiContainer(const string &mimetype)
  * @param path name of the container file.
  * @param mimetypeRequired flag indicating if the mimetype must be present and checked.
  * @param supported supported mimetypes.
- * @return returns zip serializer for the container.
+ * @return returns zip serializer for the container. Archive is kept open for reading data files on demand.
  */
-unique_ptr<ZipSerialize> ASiContainer::load(const string &path, bool mimetypeRequired, const set<string> &supported)
+const ZipSerialize &ASiContainer::load(const string &path, bool mimetypeRequired, const set<string> &supported)
 {
     DEBUG("ASiContainer::ASiContainer(path = '%s')", path.c_str());
-    unique_ptr<ZipSerialize> z( new ZipSerialize(d->path = path, false) );
+    d->zip.reset(new ZipSerialize(d->zipPath = d->path = path, false));
+    const ZipSerialize *z = d->zip.get();
 
     vector<string> list = z->list();
     if(list.empty())
@@ -101,7 +104,7 @@ unique_ptr<ZipSerialize> ASiContainer::load(const string &path, bool mimetypeReq
             THROW("Incorrect mimetype '%s'", d->mimetype.c_str());
     }
 
-    return z;
+    return *z;
 }
 
 string ASiContainer::mediaType() const
@@ -144,21 +147,15 @@ vector<Signature *> ASiContainer::signatures() const
  * <p>
  * Read a datafile from container.
  * </p>
- * If expected size of the data is too big, then stream is written to temp file.
+ * Data is not extracted, stream reads and inflates the file from zip container on demand.
  *
  * @param path name of the file in zip container stream is used to read from.
  * @param z Zip container.
  * @return returns data as a stream.
  */
-unique_ptr<iostream> ASiContainer::dataStream(const string &path, const ZipSerialize &z) const
+unique_ptr<istream> ASiContainer::dataStream(const string &path, const ZipSerialize &z) const
 {
-    unique_ptr<iostream> data;
-    if(d->properties[path].size > MAX_MEM_FILE)
-        data.reset(new fstream(File::encodeName(File::tempFileName()).c_str(), fstream::in|fstream::out|fstream::binary|fstream::trunc));
-    else
-        data.reset(new stringstream);
-    z.extract(path, *data);
-    return data;
+    return z.stream(path);
 }
 
 /**
@@ -207,6 +204,7 @@ void ASiContainer::addDataFile(unique_ptr<istream> is, const string &fileName, c
 
 void ASiContainer::addDataFileChecks(const string &fileName, const string &mediaType)
 {
+    d->documentsChanged = true;
     if(!d->signatures.empty())
         THROW("Can not add document to container which has signatures, remove all signatures before adding new document.");
     if(fileName == "mimetype")
@@ -239,6 +237,7 @@ void ASiContainer::removeDataFile(unsigned int id)
     vector<DataFile*>::const_iterator it = (d->documents.cbegin() + id);
     delete *it;
     d->documents.erase(it);
+    d->documentsChanged = true;
 }
 
 void ASiContainer::addSignature(Signature *signature)
@@ -280,6 +279,57 @@ string ASiContainer::zpath() const
     return d->path;
 }
 
+/**
+ * Returns path where container should be written. Data files of an opened container are
+ * read from its archive, so it is written to a temporary file first and moved in place with zcommit().
+ */
+string ASiContainer::zwritePath() const
+{
+    return d->zip ? d->path + ".tmp" : d->path;
+}
+
+/**
+ * Moves file written to zwritePath() to container path.
+ *
+ * @param file path returned by zwritePath().
+ * @throws Exception exception is thrown if the container file could not be replaced.
+ */
+void ASiContainer::zcommit(const string &file)
+{
+    if(file == d->path)
+        return;
+    d->zip->close();
+    if(!File::moveFile(file, d->path))
+    {
+        File::removeFile(file);
+        THROW("Failed to replace container file '%s'.", d->path.c_str());
+    }
+    d->zipPath = d->path;
+    d->documentsChanged = false;
+}
+
+/**
+ * Returns true when files can be added to the end of container archive. Possible only when
+ * container is saved to the file it was opened from and documents have not been changed.
+ */
+bool ASiContainer::zcanAppend() const
+{
+    return d->zip && !d->documentsChanged && d->zipPath == d->path;
+}
+
+/**
+ * Opens container archive for adding files to its end. Existing entries are left in place,
+ * new ones are written over the central directory. Archive is restored to its original state
+ * when returned serializer is released without <code>ZipSerialize::save()</code>.
+ *
+ * @throws Exception exception is thrown if the archive could not be opened for writing.
+ */
+unique_ptr<ZipSerialize> ASiContainer::zappend()
+{
+    d->zip->close();
+    return unique_ptr<ZipSerialize>(new ZipSerialize(d->path, true, true));
+}
+
 ZipSerialize::Properties ASiContainer::zproperty(const string &file) const
 {
     map<string, ZipSerialize::Properties>::const_iterator i = d->properties.find(file);
@@ -65,12 +65,16 @@ namespace digidoc
 
           void addDataFilePrivate(std::unique_ptr<std::istream> is, const std::string &fileName, const std::string &mediaType);
           void addSignature(Signature *signature);
-          std::unique_ptr<std::iostream> dataStream(const std::string &path, const ZipSerialize &z) const;
-          std::unique_ptr<ZipSerialize> load(const std::string &path, bool requireMimetype, const std::set<std::string> &supported);
+          std::unique_ptr<std::istream> dataStream(const std::string &path, const ZipSerialize &z) const;
+          const ZipSerialize &load(const std::string &path, bool requireMimetype, const std::set<std::string> &supported);
           void deleteSignature(Signature* s);
 
           void zpath(const std::string &file);
           std::string zpath() const;
+          std::string zwritePath() const;
+          void zcommit(const std::string &file);
+          bool zcanAppend() const;
+          std::unique_ptr<ZipSerialize> zappend();
           ZipSerialize::Properties zproperty(const std::string &file) const;
           void zproperty(const std::string &file, const ZipSerialize::Properties &prop);
 
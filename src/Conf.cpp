@@ -323,3 +323,44 @@ vector<X509Cert> ConfV4::verifyServiceCerts() const
         return {};
     return { cert };
 }
+
+
+
+/**
+ * @class digidoc::ConfV5
+ * @brief Version 5 of configuration class to add additional parameters.
+ *
+ * Conf contains virtual members and is not leaf class we need create
+ * subclasses to keep binary compatibility
+ * https://techbase.kde.org/Policies/Binary_Compatibility_Issues_With_C++#Adding_new_virtual_functions_to_leaf_classes
+ * @see digidoc::ConfV4
+ * @see @ref parameters
+ */
+/**
+ * Version 5 config with new parameters
+ */
+ConfV5::ConfV5() = default;
+
+ConfV5::~ConfV5() = default;
+
+/**
+ * Return global instance object
+ */
+ConfV5* ConfV5::instance() { return dynamic_cast<ConfV5*>(Conf::instance()); }
+
+/**
+ * Gets ZIP container deflate compression level 0-9, -1 uses zlib default level
+ */
+int ConfV5::zipCompressionLevel() const { return -1; }
+
+/**
+ * Gets number of threads used for compressing large ZIP container entries,
+ * 0 uses number of available CPU cores and 1 disables parallel compression
+ */
+int ConfV5::zipThreads() const { return 0; }
+
+/**
+ * Gets interval in seconds for refreshing TSL lists on background thread,
+ * 0 disables background refresh and lists are updated only when loaded
+ */
+int ConfV5::TSLRefreshInterval() const { return 0; }
@@ -25,10 +25,15 @@
 #include "Exception.h"
 #include "log.h"
 #include "PDF.h"
+#include "Signature.h"
 #include "SiVaContainer.h"
 #include "XmlConf.h"
+#include "crypto/Connect.h"
+#include "crypto/OCSP.h"
 #include "crypto/X509CertStore.h"
 #include "util/File.h"
+#include "util/ThreadPool.h"
+#include "xml/SecureDOMParser.h"
 
 DIGIDOCPP_WARNING_PUSH
 DIGIDOCPP_WARNING_DISABLE_CLANG("-Wnull-conversion")
@@ -56,6 +61,7 @@ using xalanc::XalanTransformer;
 #include <xsd/cxx/xml/string.hxx>
 
 #include <algorithm>
+#include <future>
 #include <sstream>
 #include <thread>
 
@@ -166,6 +172,7 @@ void digidoc::initialize(const string &appInfo, const string &userAgent, initCal
         thread([callBack]{
             try {
                 X509CertStore::instance();
+                X509CertStore::startRefresh();
                 callBack(nullptr);
             }
             catch(const Exception &e) {
@@ -174,7 +181,10 @@ void digidoc::initialize(const string &appInfo, const string &userAgent, initCal
         }).detach();
     }
     else
+    {
         X509CertStore::instance();
+        X509CertStore::startRefresh();
+    }
 }
 
 /**
@@ -185,8 +195,13 @@ void digidoc::initialize(const string &appInfo, const string &userAgent, initCal
 void digidoc::terminate()
 {
     try {
+        util::ThreadPool::stop();
+        X509CertStore::stopRefresh();
+        Connect::clearPool();
+        OCSP::clearCache();
         Conf::init(nullptr);
 
+        SecureDOMParser::clearGrammarCache();
         XSECPlatformUtils::Terminate();
 #ifdef USE_XALAN
         XalanTransformer::terminate();
@@ -358,6 +373,20 @@ unique_ptr<Container> Container::openPtr(const string &path)
     return ASiC_E::openInternal(path);
 }
 
+/**
+ * Signs container on library thread pool, so that waiting for signer, OCSP and TSA responses
+ * does not block calling thread. Container must not be modified or signed again
+ * until returned future is ready, different containers can be signed concurrently.
+ *
+ * @param signer signer implementation, must be valid until future is ready.
+ * @return future holding created signature or exception thrown by sign.
+ * @see sign
+ */
+future<Signature*> Container::signAsync(Signer *signer)
+{
+    return util::ThreadPool::run([this, signer] { return sign(signer); });
+}
+
 /**
  * @fn digidoc::Container::prepareSignature(Signer *signer)
  *
@@ -21,6 +21,7 @@
 
 #include "Exports.h"
 
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -62,6 +63,8 @@ public:
 
     virtual void addDataFile(std::unique_ptr<std::istream> is, const std::string &fileName, const std::string &mediaType);
 
+    std::future<Signature*> signAsync(Signer *signer);
+
     DIGIDOCPP_DEPRECATED static Container* create(const std::string &path);
     static std::unique_ptr<Container> createPtr(const std::string &path);
     DIGIDOCPP_DEPRECATED static Container* open(const std::string &path);
@@ -103,13 +103,14 @@ vector<unsigned char> DataFilePrivate::calcDigest(const string &method) const
 {
     if(!m_digestValue.empty())
         return m_digestValue;
-    Digest calc(method);
-    calcDigest(&calc);
-    return calc.result();
+    calcDigests({ method });
+    lock_guard<mutex> lock(m_lock);
+    return m_digests[method];
 }
 
 void DataFilePrivate::calcDigest(Digest *digest) const
 {
+    lock_guard<mutex> lock(m_lock);
     vector<unsigned char> buf(10240, 0);
     m_is->clear();
     m_is->seekg(0);
@@ -121,6 +122,38 @@ void DataFilePrivate::calcDigest(Digest *digest) const
     }
 }
 
+/**
+ * Calculates digests of all <code>methods</code> which are not calculated yet in a single
+ * read of the file and remembers the results. Document content does not change after
+ * it is added to the container, cache lives as long as the document is in the container
+ * and is shared by all signatures.
+ */
+void DataFilePrivate::calcDigests(const set<string> &methods) const
+{
+    lock_guard<mutex> lock(m_lock);
+    set<string> missing;
+    for(const string &method: methods)
+    {
+        if(m_digests.find(method) == m_digests.cend())
+            missing.insert(method);
+    }
+    if(missing.empty())
+        return;
+
+    MultiDigest calc(missing);
+    vector<unsigned char> buf(10240, 0);
+    m_is->clear();
+    m_is->seekg(0);
+    while(*m_is)
+    {
+        m_is->read((char*)buf.data(), streamsize(buf.size()));
+        if(m_is->gcount() > 0)
+            calc.update(buf.data(), size_t(m_is->gcount()));
+    }
+    for(const auto &digest: calc.result())
+        m_digests[digest.first] = digest.second;
+}
+
 void DataFilePrivate::saveAs(const string& path) const
 {
     ofstream ofs(File::encodeName(path).c_str(), ofstream::binary);
@@ -130,6 +163,7 @@ void DataFilePrivate::saveAs(const string& path) const
 
 void DataFilePrivate::saveAs(ostream &os) const
 {
+    lock_guard<mutex> lock(m_lock);
     m_is->clear();
     m_is->seekg(0);
     os << m_is->rdbuf();
@@ -22,7 +22,10 @@
 #include "DataFile.h"
 
 #include <istream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 
 namespace digidoc
 {
@@ -41,6 +44,7 @@ public:
 
 	std::vector<unsigned char> calcDigest(const std::string &method) const override;
 	void calcDigest(Digest *method) const;
+	void calcDigests(const std::set<std::string> &methods) const;
 	void saveAs(std::ostream &os) const override;
 	void saveAs(const std::string& path) const override;
 
@@ -48,5 +52,7 @@ public:
 	std::string m_id, m_filename, m_mediatype;
 	std::vector<unsigned char> m_digestValue;
 	unsigned long m_size;
+	mutable std::map<std::string,std::vector<unsigned char>> m_digests;
+	mutable std::mutex m_lock; // Guards m_is position and m_digests
 };
 }
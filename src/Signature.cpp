@@ -20,9 +20,13 @@
 #include "Signature.h"
 
 #include "Exception.h"
+#include "log.h"
 #include "crypto/X509Cert.h"
+#include "util/ThreadPool.h"
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 using namespace digidoc;
 using namespace std;
@@ -168,6 +172,19 @@ void Signature::validate(const std::string & /*policy*/) const { validate(); }
  */
 void Signature::extendSignatureProfile(const string & /*profile*/) {}
 
+/**
+ * Extends signature to selected profile on library thread pool, OCSP and TSA requests
+ * do not block calling thread. Signature must not be accessed until returned future is ready.
+ *
+ * @param profile Target profile
+ * @return future holding exception thrown by extendSignatureProfile
+ * @see extendSignatureProfile
+ */
+future<void> Signature::extendSignatureProfileAsync(const string &profile)
+{
+    return util::ThreadPool::run([this, profile] { extendSignatureProfile(profile); });
+}
+
 /**
  * Returns signature policy when it is available or empty string.
  */
@@ -298,3 +315,33 @@ std::vector<Exception::ExceptionCode> Signature::Validator::warnings() const
 {
     return d->warnings;
 }
+
+/**
+ * Validates signatures concurrently. Signatures are independent,
+ * so validation cost is divided between <code>threads</code> workers.
+ *
+ * @param signatures signatures to validate, eg. digidoc::Container::signatures().
+ * @param threads number of worker threads, 0 uses number of available CPU cores.
+ * @return returns validation result of each signature in the same order as <code>signatures</code>.
+ */
+std::vector<std::unique_ptr<Signature::Validator>> Signature::Validator::validateAll(const std::vector<Signature*> &signatures, unsigned int threads)
+{
+    std::vector<std::unique_ptr<Validator>> result(signatures.size());
+    if(threads == 0)
+        threads = max(thread::hardware_concurrency(), 1U);
+    threads = min<unsigned int>(threads, unsigned(signatures.size()));
+    DEBUG("Signature::Validator::validateAll(signatures = %lu, threads = %u)", (unsigned long)signatures.size(), threads);
+
+    atomic<size_t> next(0);
+    auto worker = [&] {
+        for(size_t i = next++; i < signatures.size(); i = next++)
+            result[i].reset(new Validator(signatures[i]));
+    };
+    std::vector<future<void>> workers;
+    for(unsigned int i = 1; i < threads; ++i)
+        workers.push_back(async(launch::async, worker));
+    worker();
+    for(future<void> &f: workers)
+        f.get();
+    return result;
+}
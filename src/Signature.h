@@ -21,6 +21,8 @@
 
 #include "Exception.h"
 
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -50,6 +52,8 @@ namespace digidoc
             Status status() const;
             std::vector<Exception::ExceptionCode> warnings() const;
 
+            static std::vector<std::unique_ptr<Validator>> validateAll(const std::vector<Signature*> &signatures, unsigned int threads = 0);
+
         private:
             DISABLE_COPY(Validator);
 
@@ -74,6 +78,7 @@ namespace digidoc
           virtual std::vector<unsigned char> dataToSign() const = 0;
           virtual void setSignatureValue(const std::vector<unsigned char> &signatureValue) = 0;
           virtual void extendSignatureProfile(const std::string &profile);
+          std::future<void> extendSignatureProfileAsync(const std::string &profile);
 
           // Xades properties
           virtual std::string policy() const;
@@ -94,10 +94,8 @@ void SignatureTST::validate() const
     {
         try
         {
-            Digest digest(timestampToken->digestMethod());
             auto dataFile = static_cast<const DataFilePrivate*>(asicSDoc->dataFiles().front());
-            dataFile->calcDigest(&digest);
-            timestampToken->verify(digest);
+            timestampToken->verify(dataFile->calcDigest(timestampToken->digestMethod()));
         }
         catch (const Exception& e)
         {
@@ -40,6 +40,8 @@ DIGIDOCPP_WARNING_DISABLE_CLANG("-Wnull-conversion")
 DIGIDOCPP_WARNING_DISABLE_GCC("-Wunused-parameter")
 DIGIDOCPP_WARNING_DISABLE_MSVC(4005)
 #include <xsec/dsig/DSIGReference.hpp>
+#include <xsec/dsig/DSIGReferenceList.hpp>
+#include <xsec/dsig/DSIGTransformList.hpp>
 #include <xsec/enc/XSECKeyInfoResolverDefault.hpp>
 #include <xsec/framework/XSECException.hpp>
 #include <xsec/framework/XSECProvider.hpp>
@@ -257,7 +259,13 @@ SignatureXAdES_B::SignatureXAdES_B(istream &sigdata, ASiContainer *bdoc, bool re
         properties.schema_location(URI_ID_DSIG, File::fullPathUrl(Conf::instance()->xsdPath() + "/xmldsig-core-schema.xsd"));
         properties.schema_location(ASIC_NAMESPACE, File::fullPathUrl(Conf::instance()->xsdPath() + "/en_31916201v010101.xsd"));
         properties.schema_location(OPENDOCUMENT_NAMESPACE, File::fullPathUrl(Conf::instance()->xsdPath() + "/OpenDocument_dsig.xsd"));
-        unique_ptr<DOMDocument> doc(SecureDOMParser(properties.schema_location()).parseIStream(is));
+        SecureDOMParser parser(properties.schema_location());
+        // DOM is kept for canonicalization and reference validation, so it must match
+        // the signed bytes: keep whitespace in element content and values as they are.
+        parser.getDomConfig()->setParameter(XMLUni::fgDOMElementContentWhitespace, true);
+        parser.getDomConfig()->setParameter(XMLUni::fgDOMDatatypeNormalization, false);
+        dom_ = parser.parseIStream(is);
+        DOMDocument *doc = dom_.get();
         /* http://www.etsi.org/deliver/etsi_ts/102900_102999/102918/01.03.01_60/ts_102918v010301p.pdf
          * 6.2.2
          * 3) The root element of each "*signatures*.xml" content shall be either:
@@ -503,13 +511,10 @@ void SignatureXAdES_B::validate(const string &policy) const
     }
 
     try {
-        stringstream ofs;
-        saveToXml(ofs);
-        unique_ptr<DOMDocument> doc(SecureDOMParser().parseIStream(ofs));
-
+        lock_guard<mutex> lock(domLock_);
         XSECProvider prov;
         auto deleteSig = [&](DSIGSignature *s) { prov.releaseSignature(s); };
-        unique_ptr<DSIGSignature, decltype(deleteSig)> sig(prov.newSignatureFromDOM(doc.get()), deleteSig);
+        unique_ptr<DSIGSignature, decltype(deleteSig)> sig(prov.newSignatureFromDOM(dom()), deleteSig);
         unique_ptr<URIResolver> uriresolver(new URIResolver(bdoc));
         unique_ptr<XSECKeyInfoResolverDefault> keyresolver(new XSECKeyInfoResolverDefault);
         sig->setURIResolver(uriresolver.get());
@@ -518,17 +523,92 @@ void SignatureXAdES_B::validate(const string &policy) const
         sig->setIdByAttributeName(true);
         sig->load();
 
+        // Same document references are resolved and verified by xml-security-c
+        auto dataFile = [&](string uri) -> const DataFilePrivate* {
+            if(uri.empty() || uri[0] == '#')
+                return nullptr;
+            uri = File::fromUriPath(uri);
+            if(!uri.empty() && uri[0] == '/')
+                uri.erase(0, 1);
+            for(const DataFile *file: bdoc->dataFiles())
+            {
+                if(file->fileName() == uri)
+                    return static_cast<const DataFilePrivate*>(file);
+            }
+            if(bdoc->mediaType() == ASiC_E::MIMETYPE_ADOC)
+            {
+                for(const DataFile *file: static_cast<ASiC_E*>(bdoc)->metaFiles())
+                {
+                    if(file->fileName() == uri)
+                        return static_cast<const DataFilePrivate*>(file);
+                }
+            }
+            return nullptr;
+        };
+
+        // Documents are read once with all digest methods used by container signatures
+        static const set<string> supported = { URI_SHA1, URI_SHA224, URI_SHA256, URI_SHA384, URI_SHA512 };
+        map<const DataFilePrivate*,set<string>> methods;
+        for(const Signature *s: bdoc->signatures())
+        {
+            const SignatureXAdES_B *other = dynamic_cast<const SignatureXAdES_B*>(s);
+            if(!other)
+                continue;
+            for(const ReferenceType &ref: other->signature->signedInfo().reference())
+            {
+                if(!ref.uRI().present() || ref.transforms().present() ||
+                    supported.find(ref.digestMethod().algorithm()) == supported.cend())
+                    continue;
+                if(const DataFilePrivate *file = dataFile(ref.uRI().get()))
+                    methods[file].insert(ref.digestMethod().algorithm());
+            }
+        }
+        for(const auto &method: methods)
+            method.first->calcDigests(method.second);
+
         safeBuffer m_errStr;
         m_errStr.sbXMLChIn((const XMLCh*)u"");
 
-        if(!DSIGReference::verifyReferenceList(sig->getReferenceList(), m_errStr))
         //if(!sig->verify()) //xml-security-c < 2.0.0 does not support URI_ID_C14N11_NOC canonicalization
+        bool valid = true;
+        DSIGReferenceList *refs = sig->getReferenceList();
+        for(DSIGReferenceList::size_type i = 0; refs && i < refs->getSize(); ++i)
+        {
+            DSIGReference *ref = refs->item(i);
+            string uri = ref->getURI() ? xml::transcode<char>(ref->getURI()) : string();
+            string method = xml::transcode<char>(ref->getAlgorithmURI());
+            const DataFilePrivate *file = ref->isManifest() || ref->getTransforms() ||
+                supported.find(method) == supported.cend() ? nullptr : dataFile(uri);
+            bool refValid = false;
+            if(file)
+            {
+                XMLByte digest[128];
+                unsigned int size = ref->readHash(digest, sizeof(digest));
+                vector<unsigned char> calc = file->calcDigest(method);
+                refValid = calc.size() == size && equal(calc.cbegin(), calc.cend(), digest);
+            }
+            else
+                refValid = ref->checkHash();
+            if(!refValid)
+            {
+                valid = false;
+                m_errStr.sbXMLChCat("Reference URI=\"");
+                m_errStr.sbXMLChCat(ref->getURI());
+                m_errStr.sbXMLChCat("\" failed to verify\n");
+            }
+            if(ref->isManifest() && !DSIGReference::verifyReferenceList(ref->getManifestReferenceList(), m_errStr))
+                valid = false;
+        }
+        if(!valid)
         {
-            //string s = xml::transcode<char>(sig->getErrMsgs());
             string s = xml::transcode<char>(m_errStr.rawXMLChBuffer());
             EXCEPTION_ADD(exception, "Failed to validate signature: %s", s.c_str());
         }
     }
+    catch(const Exception &e)
+    {
+        exception.addCause(e);
+    }
     catch(const Parsing &e)
     {
         stringstream s;
@@ -653,9 +733,7 @@ void SignatureXAdES_B::validate(const string &policy) const
 vector<unsigned char> SignatureXAdES_B::dataToSign() const
 {
     // Calculate SHA digest of the Signature->SignedInfo node.
-    Digest calc(signatureMethod());
-    calcDigestOnNode(&calc, URI_ID_DSIG, "SignedInfo");
-    return calc.result();
+    return calcDigestOnNode(signatureMethod(), URI_ID_DSIG, "SignedInfo");
 }
 
 /**
@@ -776,6 +854,7 @@ void SignatureXAdES_B::addDataObjectFormat(const string &uri, const string &mime
     DataObjectFormatType dataObject(uri);
     dataObject.mimeType(mime);
     spOpt->signedDataObjectProperties()->dataObjectFormat().push_back(dataObject);
+    clearCache();
 }
 
 /**
@@ -801,6 +880,7 @@ string SignatureXAdES_B::addReference(const string& uri, const string& digestUri
     SignedInfoType::ReferenceSequence &seq = signature->signedInfo().reference();
     reference.id(id() + Log::format("-RefId%lu", (unsigned long)seq.size()));
     seq.push_back(reference);
+    clearCache();
 
     return reference.id().get();
 }
@@ -971,7 +1051,7 @@ void SignatureXAdES_B::setSignatureValue(const vector<unsigned char> &signatureV
 
     // Set signature value id back to its old value.
     signature->signatureValue().id(id);
-    sigdata_.clear();
+    clearCache();
 }
 
 /**
@@ -985,7 +1065,7 @@ vector<unsigned char> SignatureXAdES_B::getSignatureValue() const
 
 /**
  * Canonicalize XML node using one of the supported methods in XML-DSIG
- * Using Xerces for parsing XML to preserve the white spaces "as is" and get
+ * Using cached Xerces DOM to preserve the white spaces "as is" and get
  * the same digest value on XML node each time.
  *
  * @param calc digest calculator implementation.
@@ -997,20 +1077,8 @@ void SignatureXAdES_B::calcDigestOnNode(Digest* calc, const string& ns,
 {
     try
     {
-        // Parse Xerces DOM from file, to preserve the white spaces "as is"
-        // and get the same digest value on XML node.
-        // Canonical XML 1.0 specification (http://www.w3.org/TR/2001/REC-xml-c14n-20010315)
-        // needs all the white spaces from XML file "as is", otherwise the digests won't match.
-        // Therefore we have to use Xerces to parse the XML file each time a digest needs to be
-        // calculated on a XML node. If you are parsing XML files with a parser that doesn't
-        // preserve the white spaces you are DOOMED!
-        // Parse and return a copy of the Xerces DOM tree.
-        // Save to file an parse it again, to make XML Canonicalization work
-        // correctly as expected by the Canonical XML 1.0 specification.
-        // Hope, the next Canonical XMl specification fixes the white spaces preserving "bug".
-        stringstream ofs;
-        saveToXml(ofs);
-        unique_ptr<DOMDocument> doc(SecureDOMParser().parseIStream(ofs));
+        lock_guard<mutex> lock(domLock_);
+        DOMDocument *doc = dom();
 
         DOMNode *node = nullptr;
         // Select node, on which the digest is calculated.
@@ -1028,7 +1096,7 @@ void SignatureXAdES_B::calcDigestOnNode(Digest* calc, const string& ns,
             THROW("Could not find '%s' node which is in '%s' namespace in signature XML.", tagName.c_str(), ns.c_str());
 
         string algorithmType = canonicalizationMethod.empty() ? signature->signedInfo().canonicalizationMethod().algorithm() : canonicalizationMethod;
-        SecureDOMParser::calcDigestOnNode(calc, algorithmType, doc.get(), node);
+        SecureDOMParser::calcDigestOnNode(calc, algorithmType, doc, node);
     }
     catch(const Exception& e)
     {
@@ -1061,6 +1129,67 @@ void SignatureXAdES_B::calcDigestOnNode(Digest* calc, const string& ns,
     }
 }
 
+/**
+ * Calculates digest of canonicalized node with <code>method</code>. Result is memoized
+ * until the signature is modified, so that signing, validation and extending do not
+ * canonicalize SignedInfo and SignatureValue repeatedly.
+ *
+ * @param method digest method or signature method URI.
+ * @param ns signature tag namespace.
+ * @param tagName signature tag name.
+ * @param canonicalizationMethod canonicalization method, SignedInfo method is used when empty.
+ */
+vector<unsigned char> SignatureXAdES_B::calcDigestOnNode(const string &method, const string &ns,
+        const string &tagName, const string &canonicalizationMethod) const
+{
+    string key = method + ' ' + ns + ' ' + tagName + ' ' + canonicalizationMethod;
+    {
+        lock_guard<mutex> lock(domLock_);
+        map<string,vector<unsigned char>>::const_iterator i = digests_.find(key);
+        if(i != digests_.cend())
+            return i->second;
+    }
+    Digest calc(method);
+    calcDigestOnNode(&calc, ns, tagName, {}, canonicalizationMethod);
+    vector<unsigned char> result = calc.result();
+    lock_guard<mutex> lock(domLock_);
+    digests_[key] = result;
+    return result;
+}
+
+/**
+ * Returns Xerces DOM of the signature, used for canonicalization and digest calculation.
+ * Loaded signatures reuse the DOM from their initial parse, otherwise DOM is parsed once
+ * from signature XML. DOM is kept until the signature is modified, caller must hold
+ * domLock_ while using it.
+ *
+ * Parse Xerces DOM from file, to preserve the white spaces "as is" and get the same digest
+ * value on XML node. Canonical XML 1.0 specification (http://www.w3.org/TR/2001/REC-xml-c14n-20010315)
+ * needs all the white spaces from XML file "as is", otherwise the digests won't match.
+ * Therefore the DOM is parsed from serialized XML instead of the XSD binding tree.
+ */
+DOMDocument* SignatureXAdES_B::dom() const
+{
+    if(!dom_)
+    {
+        stringstream ofs;
+        saveToXml(ofs);
+        dom_ = SecureDOMParser().parseIStream(ofs);
+    }
+    return dom_.get();
+}
+
+/**
+ * Drops cached signature XML, DOM and node digests, must be called after the signature tree is modified.
+ */
+void SignatureXAdES_B::clearCache()
+{
+    lock_guard<mutex> lock(domLock_);
+    sigdata_.clear();
+    dom_.reset();
+    digests_.clear();
+}
+
 /**
  * Saves signature to file using XAdES XML format.
  *
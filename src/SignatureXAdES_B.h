@@ -23,6 +23,9 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
+
+namespace xercesc { class DOMDocument; }
 
 namespace digidoc
 {
@@ -74,6 +77,10 @@ namespace digidoc
           xades::SignedSignaturePropertiesType& getSignedSignatureProperties() const;
           void calcDigestOnNode(Digest* calc, const std::string& ns,
               const std::string& tagName, const std::string &id = {}, const std::string &canonicalizationMethod = {}) const;
+          std::vector<unsigned char> calcDigestOnNode(const std::string &method, const std::string &ns,
+              const std::string &tagName, const std::string &canonicalizationMethod = {}) const;
+          xercesc::DOMDocument* dom() const;
+          void clearCache();
 
           static const std::string ASIC_NAMESPACE;
           static const std::string XADES_NAMESPACE;
@@ -85,6 +92,9 @@ namespace digidoc
           std::unique_ptr<asic::Document_signatures> odfsignature;
           ASiContainer *bdoc;
           std::string sigdata_;
+          mutable std::unique_ptr<xercesc::DOMDocument> dom_;
+          mutable std::map<std::string,std::vector<unsigned char>> digests_;
+          mutable std::mutex domLock_;
 
       private:
           DISABLE_COPY(SignatureXAdES_B);
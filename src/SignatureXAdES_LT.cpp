@@ -33,6 +33,7 @@ DIGIDOCPP_WARNING_DISABLE_MSVC(4005)
 DIGIDOCPP_WARNING_POP
 
 #include <ctime>
+#include <future>
 
 using namespace digidoc;
 using namespace digidoc::dsig;
@@ -210,9 +211,11 @@ void SignatureXAdES_LT::validate(const std::string &policy) const
  */
 void SignatureXAdES_LT::extendSignatureProfile(const std::string &profile)
 {
-    SignatureXAdES_T::extendSignatureProfile(profile);
     if(profile == ASiC_E::BES_PROFILE || profile == ASiC_E::EPES_PROFILE)
+    {
+        SignatureXAdES_T::extendSignatureProfile(profile);
         return;
+    }
 
     // Calculate NONCE value.
     Digest calc;
@@ -227,13 +230,36 @@ void SignatureXAdES_LT::extendSignatureProfile(const std::string &profile)
         THROW("Could not find certificate issuer '%s' in certificate store.",
             cert.issuerName().c_str());
 
-    OCSP ocsp(cert, issuer, nonce, bdoc->mediaType(), profile.find(ASiC_E::ASIC_TM_PROFILE) != string::npos);
+    string format = bdoc->mediaType();
+    bool TMProfile = profile.find(ASiC_E::ASIC_TM_PROFILE) != string::npos;
+    OCSP ocsp;
+    if(profile.find(ASiC_E::ASIC_TS_PROFILE) != string::npos)
+    {
+        // Nonce and TimeStamp depend only on SignatureValue, request OCSP while waiting TimeStamp
+        future<OCSP> request = async(launch::async, [&] {
+            return OCSP(cert, issuer, nonce, format, TMProfile);
+        });
+        SignatureXAdES_T::extendSignatureProfile(profile);
+        ocsp = request.get();
+        // LT level requires OCSP to be produced after TimeStamp, request again when responder was faster
+        if(util::date::string2time_t(TimeStampTime()) > util::date::ASN1TimeToTime_t(ocsp.producedAt()))
+        {
+            DEBUG("OCSP producedAt %s is before TimeStamp time %s, requesting again",
+                ocsp.producedAt().c_str(), TimeStampTime().c_str());
+            ocsp = OCSP(cert, issuer, nonce, format, TMProfile);
+        }
+    }
+    else
+    {
+        SignatureXAdES_T::extendSignatureProfile(profile);
+        ocsp = OCSP(cert, issuer, nonce, format, TMProfile);
+    }
     ocsp.verifyResponse(cert);
 
     addCertificateValue(id() + "-RESPONDER_CERT", ocsp.responderCert());
     addCertificateValue(id() + "-CA-CERT", issuer);
     addOCSPValue(id().replace(0, 1, "N"), ocsp);
-    sigdata_.clear();
+    clearCache();
 }
 
 /**
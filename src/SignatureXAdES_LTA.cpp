@@ -26,7 +26,6 @@
 #include "crypto/TS.h"
 #include "crypto/X509Cert.h"
 #include "util/DateTime.h"
-#include "xml/SecureDOMParser.h"
 #include "xml/XAdES01903v141-201601.hxx"
 #include "xml/URIResolver.h"
 
@@ -62,11 +61,10 @@ SignatureXAdES_LTA::SignatureXAdES_LTA(std::istream &sigdata, ASiContainer *bdoc
 void SignatureXAdES_LTA::calcArchiveDigest(Digest *digest) const
 {
     try {
-        stringstream ofs;
-        saveToXml(ofs);
+        lock_guard<mutex> lock(domLock_);
         XSECProvider prov;
         auto deleteSig = [&](DSIGSignature *s) { prov.releaseSignature(s); };
-        unique_ptr<DSIGSignature,decltype(deleteSig)> sig(prov.newSignatureFromDOM(SecureDOMParser().parseIStream(ofs).release()), deleteSig);
+        unique_ptr<DSIGSignature,decltype(deleteSig)> sig(prov.newSignatureFromDOM(dom()), deleteSig);
         unique_ptr<URIResolver> uriresolver(new URIResolver(bdoc));
         unique_ptr<XSECKeyInfoResolverDefault> keyresolver(new XSECKeyInfoResolverDefault);
         sig->setURIResolver(uriresolver.get());
@@ -176,7 +174,7 @@ void SignatureXAdES_LTA::extendSignatureProfile(const std::string &profile)
         UnsignedSignaturePropertiesType::ContentOrderType(
             UnsignedSignaturePropertiesType::archiveTimeStampV141Id,
             unsignedSignatureProperties().archiveTimeStampV141().size() - 1));
-    sigdata_.clear();
+    clearCache();
 }
 
 TS SignatureXAdES_LTA::tsaFromBase64() const
@@ -90,7 +90,7 @@ void SignatureXAdES_T::extendSignatureProfile(const std::string &profile)
         UnsignedSignaturePropertiesType::ContentOrderType(
             UnsignedSignaturePropertiesType::signatureTimeStampId,
             unsignedSignatureProperties().signatureTimeStamp().size() - 1));
-    sigdata_.clear();
+    clearCache();
 }
 
 TS SignatureXAdES_T::tsFromBase64() const
@@ -154,9 +154,7 @@ void SignatureXAdES_T::validate(const std::string &policy) const
             canonicalizationMethod = ts.canonicalizationMethod()->algorithm();
 
         TS tsa((const unsigned char*)bin.data(), bin.size());
-        Digest calc(tsa.digestMethod());
-        calcDigestOnNode(&calc, URI_ID_DSIG, "SignatureValue", {}, canonicalizationMethod);
-        tsa.verify(calc);
+        tsa.verify(calcDigestOnNode(tsa.digestMethod(), URI_ID_DSIG, "SignatureValue", canonicalizationMethod));
 
         time_t validateTime = util::date::ASN1TimeToTime_t(tsa.time());
         if(!signingCertificate().isValid(&validateTime))
@@ -101,6 +101,9 @@ public:
     XmlConfParam<bool> TSLOnlineDigest = {"tsl.onlineDigest", true};
     XmlConfParam<int> TSLTimeOut = {"tsl.timeOut", 10};
     XmlConfParam<string> verifyServiceUri = {"verify.serivceUri"};
+    XmlConfParam<int> zipCompressionLevel = {"zip.compressionLevel", -1};
+    XmlConfParam<int> zipThreads = {"zip.threads", 0};
+    XmlConfParam<int> TSLRefreshInterval = {"tsl.refreshInterval", 0};
     map<string,string> ocsp;
     std::set<std::string> ocspTMProfiles;
 
@@ -200,6 +203,12 @@ void XmlConf::Private::init(const string& path, bool global)
                 TSLTimeOut.setValue(stoi(p), p.lock(), global);
             else if(p.name() == verifyServiceUri.name)
                 verifyServiceUri.setValue(p, p.lock(), global);
+            else if(p.name() == zipCompressionLevel.name)
+                zipCompressionLevel.setValue(stoi(p), p.lock(), global);
+            else if(p.name() == zipThreads.name)
+                zipThreads.setValue(stoi(p), p.lock(), global);
+            else if(p.name() == TSLRefreshInterval.name)
+                TSLRefreshInterval.setValue(stoi(p), p.lock(), global);
             else if(p.name() == "ocsp.tm.profile" && global)
                 ocspTMProfiles.emplace(p);
             else
@@ -343,7 +352,7 @@ XmlConfV3::~XmlConfV3() { delete d; }
 XmlConfV3* XmlConfV3::instance() { return dynamic_cast<XmlConfV3*>(Conf::instance()); }
 
 /**
- * Initialize xml conf from path
+ * @deprecated See digidoc::XmlConfV5::XmlConfV5
  */
 XmlConfV4::XmlConfV4(const string &path, const string &schema)
     : d(new XmlConf::Private(path, schema.empty() ? File::path(xsdPath(), "conf.xsd") : schema))
@@ -351,13 +360,23 @@ XmlConfV4::XmlConfV4(const string &path, const string &schema)
 XmlConfV4::~XmlConfV4() { delete d; }
 XmlConfV4* XmlConfV4::instance() { return dynamic_cast<XmlConfV4*>(Conf::instance()); }
 
+/**
+ * Initialize xml conf from path
+ */
+XmlConfV5::XmlConfV5(const string &path, const string &schema)
+    : d(new XmlConf::Private(path, schema.empty() ? File::path(xsdPath(), "conf.xsd") : schema))
+{}
+XmlConfV5::~XmlConfV5() { delete d; }
+XmlConfV5* XmlConfV5::instance() { return dynamic_cast<XmlConfV5*>(Conf::instance()); }
+
 
 
 #define GET1(TYPE, PROP) \
 TYPE XmlConf::PROP() const { return d->PROP.value(Conf::PROP()); } \
 TYPE XmlConfV2::PROP() const { return d->PROP.value(Conf::PROP()); } \
 TYPE XmlConfV3::PROP() const { return d->PROP.value(Conf::PROP()); } \
-TYPE XmlConfV4::PROP() const { return d->PROP.value(Conf::PROP()); }
+TYPE XmlConfV4::PROP() const { return d->PROP.value(Conf::PROP()); } \
+TYPE XmlConfV5::PROP() const { return d->PROP.value(Conf::PROP()); }
 
 #define SET1(TYPE, SET, PROP) \
 void XmlConf::SET(TYPE PROP) \
@@ -367,6 +386,8 @@ void XmlConfV2::SET(TYPE PROP) \
 void XmlConfV3::SET(TYPE PROP) \
 { d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); } \
 void XmlConfV4::SET(TYPE PROP) \
+{ d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); } \
+void XmlConfV5::SET(TYPE PROP) \
 { d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); }
 
 #define SET1CONST(TYPE, SET, PROP) \
@@ -377,6 +398,8 @@ void XmlConfV2::SET(const TYPE &(PROP)) \
 void XmlConfV3::SET(const TYPE &(PROP)) \
 { d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); } \
 void XmlConfV4::SET(const TYPE &(PROP)) \
+{ d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); } \
+void XmlConfV5::SET(const TYPE &(PROP)) \
 { d->setUserConf<TYPE>(d->PROP, Conf::PROP(), PROP); }
 
 GET1(int, logLevel)
@@ -400,6 +423,21 @@ GET1(bool, TSLOnlineDigest)
 GET1(int, TSLTimeOut)
 GET1(string, verifyServiceUri)
 
+int XmlConfV5::zipCompressionLevel() const
+{
+    return d->zipCompressionLevel.value(ConfV5::zipCompressionLevel());
+}
+
+int XmlConfV5::zipThreads() const
+{
+    return d->zipThreads.value(ConfV5::zipThreads());
+}
+
+int XmlConfV5::TSLRefreshInterval() const
+{
+    return d->TSLRefreshInterval.value(ConfV5::TSLRefreshInterval());
+}
+
 string XmlConf::ocsp(const string &issuer) const
 {
     auto i = d->ocsp.find(issuer);
@@ -424,6 +462,12 @@ string XmlConfV4::ocsp(const string &issuer) const
     return i != d->ocsp.end() ? i->second : Conf::ocsp(issuer);
 }
 
+string XmlConfV5::ocsp(const string &issuer) const
+{
+    auto i = d->ocsp.find(issuer);
+    return i != d->ocsp.end() ? i->second : Conf::ocsp(issuer);
+}
+
 /**
  * @fn void digidoc::XmlConf::setTSLOnlineDigest( bool enable )
  * Enables/Disables online digest check
@@ -439,6 +483,36 @@ SET1(bool, setTSLOnlineDigest, TSLOnlineDigest)
  */
 SET1(int, setTSLTimeOut, TSLTimeOut)
 
+/**
+ * Sets ZIP container deflate compression level
+ * @param level Compression level 0-9, -1 uses zlib default level
+ * @throws Exception exception is thrown if saving a compression level into a user configuration file fails.
+ */
+void XmlConfV5::setZipCompressionLevel(int level)
+{
+    d->setUserConf<int>(d->zipCompressionLevel, ConfV5::zipCompressionLevel(), level);
+}
+
+/**
+ * Sets number of threads used for compressing large ZIP container entries
+ * @param threads Number of threads, 0 uses number of available CPU cores
+ * @throws Exception exception is thrown if saving a thread count into a user configuration file fails.
+ */
+void XmlConfV5::setZipThreads(int threads)
+{
+    d->setUserConf<int>(d->zipThreads, ConfV5::zipThreads(), threads);
+}
+
+/**
+ * Sets interval for refreshing TSL lists on background thread
+ * @param interval Interval in seconds, 0 disables background refresh
+ * @throws Exception exception is thrown if saving a refresh interval into a user configuration file fails.
+ */
+void XmlConfV5::setTSLRefreshInterval(int interval)
+{
+    d->setUserConf<int>(d->TSLRefreshInterval, ConfV5::TSLRefreshInterval(), interval);
+}
+
 /**
  * @fn void digidoc::XmlConf::setProxyHost(const std::string &host)
  * Sets a Proxy host address. Also adds or replaces proxy host data in the user configuration file.
@@ -536,6 +610,11 @@ X509Cert XmlConfV4::verifyServiceCert() const
     return ConfV4::verifyServiceCert();
 }
 
+X509Cert XmlConfV5::verifyServiceCert() const
+{
+    return ConfV5::verifyServiceCert();
+}
+
 set<string> XmlConfV3::OCSPTMProfiles() const
 {
     return d->ocspTMProfiles.empty() ? ConfV3::OCSPTMProfiles() : d->ocspTMProfiles;
@@ -546,7 +625,17 @@ set<string> XmlConfV4::OCSPTMProfiles() const
     return d->ocspTMProfiles.empty() ? ConfV3::OCSPTMProfiles() : d->ocspTMProfiles;
 }
 
+set<string> XmlConfV5::OCSPTMProfiles() const
+{
+    return d->ocspTMProfiles.empty() ? ConfV3::OCSPTMProfiles() : d->ocspTMProfiles;
+}
+
 vector<X509Cert> XmlConfV4::verifyServiceCerts() const
 {
     return ConfV4::verifyServiceCerts();
 }
+
+vector<X509Cert> XmlConfV5::verifyServiceCerts() const
+{
+    return ConfV5::verifyServiceCerts();
+}
@@ -31,6 +31,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <mutex>
 #include <thread>
 
 using namespace digidoc;
@@ -45,24 +46,113 @@ static X509 *X509_STORE_CTX_get0_cert(X509_STORE_CTX *ctx)
 }
 #endif
 
+namespace {
+/**
+ * Process wide keep-alive pool. Idle connections are keyed by connection target, TLS contexts
+ * by pinned certificates and TLS sessions by connection target for resumption.
+ */
+class Pool
+{
+public:
+    struct Entry {
+        BIO *bio;
+        chrono::steady_clock::time_point expires;
+    };
+    static const size_t MAX_IDLE = 4;
+
+    ~Pool()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lock(m);
+        for(const pair<const string,Entry> &it: idle)
+            BIO_free_all(it.second.bio);
+        idle.clear();
+        sessions.clear();
+        contexts.clear();
+    }
+
+    static Pool& instance()
+    {
+        // Constructed on first use, after OpenSSL is initialized, and destroyed before its cleanup
+        static Pool pool;
+        return pool;
+    }
+
+    mutex m;
+    multimap<string,Entry> idle;
+    map<string,shared_ptr<SSL_CTX>> contexts;
+    map<string,shared_ptr<SSL_SESSION>> sessions;
+};
+
+/**
+ * Pinned certificates used by verify callback are owned by SSL_CTX and released with
+ * last reference to it, connections in use keep them alive after pool is cleared.
+ */
+int certsIndex()
+{
+    static const int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr,
+        [](void * /*parent*/, void *ptr, CRYPTO_EX_DATA * /*ad*/, int /*idx*/, long /*argl*/, void * /*argp*/) {
+            delete static_cast<vector<X509Cert>*>(ptr);
+        });
+    return idx;
+}
+
+string lower(string str)
+{
+    transform(str.begin(), str.end(), str.begin(), ::tolower);
+    return str;
+}
+
+/**
+ * Checks that idle connection is not closed by server. Socket is switched temporary to
+ * non-blocking mode, any pending data or end of stream means connection is not usable.
+ */
+bool isAlive(BIO *bio, bool nbio)
+{
+    int fd = -1;
+    if(BIO_get_fd(bio, &fd) <= 0 || fd < 0)
+        return false;
+    BIO_socket_nbio(fd, 1);
+    char c = 0;
+    bool result = BIO_read(bio, &c, 1) <= 0 && BIO_should_retry(bio);
+    BIO_socket_nbio(fd, nbio);
+    return result;
+}
+
+string header(const Connect::Result &r, const string &name)
+{
+    for(const pair<const string,string> &it: r.headers)
+    {
+        if(lower(it.first) == name)
+            return it.second;
+    }
+    return string();
+}
+}
+
 Connect::Connect(const string &_url, const string &method, int timeout, const string &useragent, const std::vector<X509Cert> &certs)
-    : _timeout(timeout)
+    : method(method)
+    , certs(certs)
+    , _timeout(timeout)
 {
     DEBUG("Connecting to URL: %s", _url.c_str());
     char *_host = nullptr, *_port = nullptr, *_path = nullptr;
-    int usessl = 0;
     if(!OCSP_parse_url(const_cast<char*>(_url.c_str()), &_host, &_port, &_path, &usessl))
         THROW_NETWORKEXCEPTION("Incorrect URL provided: '%s'.", _url.c_str());
 
-    string host = _host ? _host : "";
-    string port = _port ? _port : "80";
+    host = _host ? _host : "";
+    port = _port ? _port : "80";
     string path = _path ? _path : "/";
     string url = (_path && strlen(_path) == 1 && _path[0] == '/' && _url[_url.size() - 1] != '/') ? _url + "/" : _url;
     OPENSSL_free(_host);
     OPENSSL_free(_port);
     OPENSSL_free(_path);
 
-    string hostname = host + ":" + port;
+    hostname = host + ":" + port;
     Conf *c = Conf::instance();
     if(!c->proxyHost().empty() && (usessl == 0 || (CONF(proxyForceSSL)) || (CONF(proxyTunnelSSL))))
     {
@@ -70,71 +160,45 @@ Connect::Connect(const string &_url, const string &method, int timeout, const st
         path = url;
     }
 
-    DEBUG("Connecting to Host: %s timeout: %i", hostname.c_str(), _timeout);
-    d = BIO_new_connect(const_cast<char*>(hostname.c_str()));
-    if(!d)
-        THROW_NETWORKEXCEPTION("Failed to create connection with host: '%s'", hostname.c_str());
-
-    BIO_set_nbio(d, _timeout > 0);
-    auto start = chrono::high_resolution_clock::now();
-    while(BIO_do_connect(d) != 1)
+    // Connections are reusable only with same target, proxy, TLS pinning and blocking mode
+    key = hostname + "|" + host + ":" + port + "|" + to_string(usessl) + "|" + to_string(_timeout > 0);
+    for(const X509Cert &cert: certs)
     {
-        if(_timeout == 0)
-            THROW_NETWORKEXCEPTION("Failed to connect to host: '%s'", hostname.c_str());
-        if(!BIO_should_retry(d))
-            THROW_NETWORKEXCEPTION("Failed to connect to host: '%s'", hostname.c_str());
-        auto end = chrono::high_resolution_clock::now();
-        if(chrono::duration_cast<chrono::seconds>(end - start).count() >= _timeout)
-            THROW_NETWORKEXCEPTION("Failed to create connection with host timeout: '%s'", hostname.c_str());
-        this_thread::sleep_for(chrono::milliseconds(50));
+        vector<unsigned char> der = cert;
+        key.append(der.cbegin(), der.cend());
     }
 
-    if(usessl > 0)
     {
-        if(!c->proxyHost().empty() && (CONF(proxyTunnelSSL)))
-        {
-            BIO_printf(d, "CONNECT %s:%s HTTP/1.0\r\n", host.c_str(), port.c_str());
-            addHeader("Host", host + ":" + port);
-            sendProxyAuth();
-            _timeout = 1; // Don't wait additional data on read, case proxy tunnel
-            Result r = exec();
-            if(!r.isOK() || r.result.find("established") == string::npos)
-                THROW_NETWORKEXCEPTION("Failed to create proxy connection with host: '%s'", hostname.c_str());
-            _timeout = timeout; // Restore
-        }
-
-        ssl.reset(SSL_CTX_new(SSLv23_client_method()), SSL_CTX_free);
-        if(!ssl)
-            THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
-        SSL_CTX_set_mode(ssl.get(), SSL_MODE_AUTO_RETRY);
-        SSL_CTX_set_quiet_shutdown(ssl.get(), 1);
-        if(!certs.empty())
+        Pool &pool = Pool::instance();
+        lock_guard<mutex> lock(pool.m);
+        auto now = chrono::steady_clock::now();
+        for(auto it = pool.idle.begin(); it != pool.idle.end();)
         {
-            SSL_CTX_set_verify(ssl.get(), SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
-            SSL_CTX_set_cert_verify_callback(ssl.get(), [](X509_STORE_CTX *store, void *data) -> int {
-                X509 *x509 = X509_STORE_CTX_get0_cert(store);
-                vector<X509Cert> *certs = (vector<X509Cert>*)data;
-                return any_of(certs->cbegin(), certs->cend(), [x509](const X509Cert &cert) {
-                    return cert == x509;
-                }) ? 1 : 0;
-            }, const_cast<vector<X509Cert>*>(&certs));
+            if(it->second.expires > now)
+            {
+                ++it;
+                continue;
+            }
+            BIO_free_all(it->second.bio);
+            it = pool.idle.erase(it);
         }
-        BIO *sbio = BIO_new_ssl(ssl.get(), 1);
-        if(!sbio)
-            THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
-        d = BIO_push(sbio, d);
-        while(BIO_do_handshake(d) != 1)
+        for(auto it = pool.idle.find(key); it != pool.idle.end() && it->first == key && !d;)
         {
-            if(_timeout == 0)
-                THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
-            auto end = chrono::high_resolution_clock::now();
-            if(chrono::duration_cast<chrono::seconds>(end - start).count() >= _timeout)
-                THROW_NETWORKEXCEPTION("Failed to create ssl connection with host timeout: '%s'", hostname.c_str());
-            this_thread::sleep_for(chrono::milliseconds(50));
+            if(isAlive(it->second.bio, _timeout > 0))
+            {
+                DEBUG("Reusing connection to Host: %s", hostname.c_str());
+                d = it->second.bio;
+                reused = true;
+            }
+            else
+                BIO_free_all(it->second.bio);
+            it = pool.idle.erase(it);
         }
     }
+    if(!d)
+        connect();
 
-    BIO_printf(d, "%s %s HTTP/1.0\r\n", method.c_str(), path.c_str());
+    request = method + " " + path + " HTTP/1.1\r\n";
     if(port == "80")
         addHeader("Host", host);
     else
@@ -142,7 +206,7 @@ Connect::Connect(const string &_url, const string &method, int timeout, const st
     if(!userAgent().empty())
         addHeader("User-Agent", "LIB libdigidocpp/" + string(FILE_VER_STR) + " APP " + userAgent() + useragent);
     if(usessl == 0)
-        sendProxyAuth();
+        request += proxyAuth();
 }
 
 Connect::~Connect()
@@ -153,7 +217,7 @@ Connect::~Connect()
 
 void Connect::addHeader(const string &key, const string &value)
 {
-    BIO_printf(d, "%s: %s\r\n", key.c_str(), value.c_str());
+    request += key + ": " + value + "\r\n";
 }
 
 void Connect::addHeaders(initializer_list<pair<string,string>> headers)
@@ -162,6 +226,111 @@ void Connect::addHeaders(initializer_list<pair<string,string>> headers)
         addHeader(it.first, it.second);
 }
 
+/**
+ * Releases idle connections and cached TLS sessions.
+ */
+void Connect::clearPool()
+{
+    Pool::instance().clear();
+}
+
+void Connect::connect()
+{
+    DEBUG("Connecting to Host: %s timeout: %i", hostname.c_str(), _timeout);
+    reused = false;
+    d = BIO_new_connect(const_cast<char*>(hostname.c_str()));
+    if(!d)
+        THROW_NETWORKEXCEPTION("Failed to create connection with host: '%s'", hostname.c_str());
+
+    BIO_set_nbio(d, _timeout > 0);
+    start = chrono::steady_clock::now();
+    while(BIO_do_connect(d) != 1)
+    {
+        if(_timeout == 0)
+            THROW_NETWORKEXCEPTION("Failed to connect to host: '%s'", hostname.c_str());
+        if(!BIO_should_retry(d))
+            THROW_NETWORKEXCEPTION("Failed to connect to host: '%s'", hostname.c_str());
+        auto end = chrono::steady_clock::now();
+        if(chrono::duration_cast<chrono::seconds>(end - start).count() >= _timeout)
+            THROW_NETWORKEXCEPTION("Failed to create connection with host timeout: '%s'", hostname.c_str());
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+
+    if(usessl == 0)
+        return;
+
+    Conf *c = Conf::instance();
+    if(!c->proxyHost().empty() && (CONF(proxyTunnelSSL)))
+    {
+        send("CONNECT " + host + ":" + port + " HTTP/1.1\r\n"
+            "Host: " + host + ":" + port + "\r\n" + proxyAuth() + "\r\n");
+        Result r = readResponse(true);
+        if(!r.isOK() || r.result.find("established") == string::npos)
+            THROW_NETWORKEXCEPTION("Failed to create proxy connection with host: '%s'", hostname.c_str());
+    }
+
+    Pool &pool = Pool::instance();
+    shared_ptr<SSL_SESSION> session;
+    shared_ptr<SSL_CTX> ssl;
+    {
+        lock_guard<mutex> lock(pool.m);
+        auto s = pool.sessions.find(key);
+        if(s != pool.sessions.cend())
+            session = s->second;
+
+        string ctxKey;
+        for(const X509Cert &cert: certs)
+        {
+            vector<unsigned char> der = cert;
+            ctxKey.append(der.cbegin(), der.cend());
+        }
+        shared_ptr<SSL_CTX> &context = pool.contexts[ctxKey];
+        if(!context)
+        {
+            context.reset(SSL_CTX_new(SSLv23_client_method()), SSL_CTX_free);
+            if(!context)
+                THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
+            SSL_CTX_set_mode(context.get(), SSL_MODE_AUTO_RETRY);
+            SSL_CTX_set_quiet_shutdown(context.get(), 1);
+            SSL_CTX_set_session_cache_mode(context.get(), SSL_SESS_CACHE_CLIENT);
+            if(!certs.empty())
+            {
+                vector<X509Cert> *data = new vector<X509Cert>(certs);
+                SSL_CTX_set_ex_data(context.get(), certsIndex(), data);
+                SSL_CTX_set_verify(context.get(), SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+                SSL_CTX_set_cert_verify_callback(context.get(), [](X509_STORE_CTX *store, void *data) -> int {
+                    X509 *x509 = X509_STORE_CTX_get0_cert(store);
+                    vector<X509Cert> *certs = (vector<X509Cert>*)data;
+                    return any_of(certs->cbegin(), certs->cend(), [x509](const X509Cert &cert) {
+                        return cert == x509;
+                    }) ? 1 : 0;
+                }, data);
+            }
+        }
+        ssl = context;
+    }
+
+    BIO *sbio = BIO_new_ssl(ssl.get(), 1);
+    if(!sbio)
+        THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
+    SSL *s = nullptr;
+    BIO_get_ssl(sbio, &s);
+    if(session)
+        SSL_set_session(s, session.get());
+    d = BIO_push(sbio, d);
+    while(BIO_do_handshake(d) != 1)
+    {
+        if(_timeout == 0)
+            THROW_NETWORKEXCEPTION("Failed to create ssl connection with host: '%s'", hostname.c_str());
+        auto end = chrono::steady_clock::now();
+        if(chrono::duration_cast<chrono::seconds>(end - start).count() >= _timeout)
+            THROW_NETWORKEXCEPTION("Failed to create ssl connection with host timeout: '%s'", hostname.c_str());
+        this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    if(session && SSL_session_reused(s))
+        DEBUG("Resumed TLS session with host: %s", hostname.c_str());
+}
+
 Connect::Result Connect::exec(initializer_list<pair<string,string>> headers,
     const vector<unsigned char> &data)
 {
@@ -173,54 +342,58 @@ Connect::Result Connect::exec(initializer_list<pair<string,string>> headers,
 {
     addHeaders(headers);
     if(size != 0)
-    {
         addHeader("Content-Length", to_string(size));
-        BIO_printf(d, "\r\n");
-        BIO_write(d, data, int(size));
+    request += "\r\n";
+    if(size != 0)
+        request.append((const char*)data, size);
+
+    // Server may have closed idle connection after it was taken from pool
+    if(reused && !isAlive(d, _timeout > 0))
+    {
+        DEBUG("Pooled connection to Host: %s was closed, reconnecting", hostname.c_str());
+        BIO_free_all(d);
+        d = nullptr;
+        connect();
     }
-    else
-        BIO_printf(d, "\r\n");
 
-    int rc = 0;
-    size_t pos = 0;
     Result r;
-    r.content.resize(1024);
-    chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
-    do {
-        if(rc > 0 && (pos += size_t(rc)) >= r.content.size())
-            r.content.resize(r.content.size()*2);
-        rc = BIO_read(d, &r.content[pos], int(r.content.size() - pos));
-        if(rc == -1 && BIO_should_read(d) != 1)
-            break;
-        auto end = chrono::high_resolution_clock::now();
-        if(_timeout > 0 && _timeout < chrono::duration_cast<chrono::seconds>(end - start).count())
-            break;
-    } while(rc != 0);
-    r.content.resize(pos);
+    start = chrono::steady_clock::now();
+    received = 0;
+    if(send(request))
+        r = readResponse(method == "HEAD");
+    // Server may still close reused connection while request is written, retry once on new
+    // connection when no response was received. Server does not process request on connection
+    // it has closed without responding.
+    if(reused && received == 0)
+    {
+        DEBUG("Pooled connection to Host: %s was closed, reconnecting", hostname.c_str());
+        BIO_free_all(d);
+        d = nullptr;
+        connect();
+        start = chrono::steady_clock::now();
+        r = send(request) ? readResponse(method == "HEAD") : Result();
+    }
 
-    stringstream stream(r.content);
-    string line;
-    while(getline(stream, line))
+    if(keepAlive)
     {
-        line.resize(line.size() - 1);
-        if(line.empty())
-            break;
-        if(r.result.empty())
+        // Keep-Alive: timeout=5, max=100
+        chrono::seconds idle(5);
+        string keepAliveHeader = header(r, "keep-alive");
+        size_t pos = keepAliveHeader.find("timeout=");
+        if(pos != string::npos)
+            idle = chrono::seconds(max(0, atoi(keepAliveHeader.c_str() + pos + 8) - 1));
+        Pool &pool = Pool::instance();
+        lock_guard<mutex> lock(pool.m);
+        SSL *s = nullptr;
+        if(usessl > 0 && BIO_get_ssl(d, &s) > 0 && s)
+            pool.sessions[key].reset(SSL_get1_session(s), SSL_SESSION_free);
+        if(idle.count() > 0 && pool.idle.count(key) < Pool::MAX_IDLE)
         {
-            r.result = line;
-            continue;
+            pool.idle.insert({key, {d, chrono::steady_clock::now() + idle}});
+            d = nullptr;
         }
-        size_t split = line.find(": ");
-        if(split != string::npos)
-            r.headers[line.substr(0, split)] = line.substr(split + 2);
-        else
-            r.headers[line] = string();
     }
 
-    pos = r.content.find("\r\n\r\n");
-    if(pos != string::npos)
-        r.content.erase(0, pos + 4);
-
     if(r.content.empty())
         return r;
 
@@ -264,18 +437,163 @@ Connect::Result Connect::exec(initializer_list<pair<string,string>> headers,
     return r;
 }
 
-void Connect::sendProxyAuth()
+/**
+ * Reads next block from connection and appends it to data.
+ * @return false when connection was closed, failed or timeout was reached
+ */
+bool Connect::read(string &data)
+{
+    char buf[16 * 1024];
+    while(true)
+    {
+        int rc = BIO_read(d, buf, sizeof(buf));
+        if(rc > 0)
+        {
+            received += size_t(rc);
+            data.append(buf, size_t(rc));
+            return true;
+        }
+        if(!BIO_should_retry(d))
+            return false;
+        auto end = chrono::steady_clock::now();
+        if(_timeout > 0 && _timeout < chrono::duration_cast<chrono::seconds>(end - start).count())
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+/**
+ * Reads one response from connection. Body is delimited by Content-Length or chunked
+ * Transfer-Encoding, otherwise it is read until server closes connection. Connection is
+ * marked reusable only when response was fully consumed and server allows keep-alive.
+ */
+Connect::Result Connect::readResponse(bool headOnly)
+{
+    keepAlive = false;
+    Result r;
+    string data;
+    size_t pos = 0;
+    while((pos = data.find("\r\n\r\n")) == string::npos)
+    {
+        if(!read(data))
+            return r;
+    }
+
+    stringstream stream(data.substr(0, pos + 2));
+    string line;
+    while(getline(stream, line))
+    {
+        line.resize(line.size() - 1);
+        if(line.empty())
+            break;
+        if(r.result.empty())
+        {
+            r.result = line;
+            continue;
+        }
+        size_t split = line.find(": ");
+        if(split != string::npos)
+            r.headers[line.substr(0, split)] = line.substr(split + 2);
+        else
+            r.headers[line] = string();
+    }
+    data.erase(0, pos + 4);
+
+    bool complete = true;
+    string transferEncoding = lower(header(r, "transfer-encoding"));
+    string contentLength = header(r, "content-length");
+    if(headOnly || r.isStatusCode(" 204 ") || r.isStatusCode(" 304 "))
+        complete = data.empty();
+    else if(transferEncoding.find("chunked") != string::npos)
+    {
+        pos = 0;
+        while(complete)
+        {
+            size_t eol = 0;
+            while(complete && (eol = data.find("\r\n", pos)) == string::npos)
+                complete = read(data);
+            if(!complete)
+                break;
+            size_t len = strtoul(data.c_str() + pos, nullptr, 16);
+            pos = eol + 2;
+            if(len == 0)
+            {
+                // Skip trailers until empty line
+                while(complete && (eol = data.find("\r\n", pos)) != pos)
+                {
+                    if(eol == string::npos)
+                        complete = read(data);
+                    else
+                        pos = eol + 2;
+                }
+                pos += 2;
+                break;
+            }
+            while(complete && data.size() < pos + len + 2)
+                complete = read(data);
+            if(!complete)
+                break;
+            r.content.append(data, pos, len);
+            pos += len + 2;
+        }
+        complete = complete && pos == data.size();
+    }
+    else if(!contentLength.empty())
+    {
+        size_t len = strtoul(contentLength.c_str(), nullptr, 10);
+        while(complete && data.size() < len)
+            complete = read(data);
+        complete = complete && data.size() == len;
+        r.content = move(data);
+    }
+    else
+    {
+        while(read(data));
+        r.content = move(data);
+        return r;
+    }
+
+    keepAlive = complete && r.result.compare(0, 8, "HTTP/1.1") == 0 &&
+        lower(header(r, "connection")).find("close") == string::npos;
+    return r;
+}
+
+bool Connect::send(const string &data)
+{
+    size_t pos = 0;
+    while(pos < data.size())
+    {
+        int rc = BIO_write(d, data.c_str() + pos, int(data.size() - pos));
+        if(rc > 0)
+        {
+            pos += size_t(rc);
+            continue;
+        }
+        if(!BIO_should_retry(d))
+            return false;
+        auto end = chrono::steady_clock::now();
+        if(_timeout > 0 && _timeout < chrono::duration_cast<chrono::seconds>(end - start).count())
+            return false;
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    (void)BIO_flush(d);
+    return true;
+}
+
+string Connect::proxyAuth()
 {
     Conf *c = Conf::instance();
     if(c->proxyUser().empty() || c->proxyPass().empty())
-        return;
+        return string();
 
-    BIO_printf(d, "Proxy-Authorization: Basic ");
+    SCOPE(BIO, mem, BIO_new(BIO_s_mem()));
     SCOPE(BIO, b64, BIO_new(BIO_f_base64()));
     BIO_set_flags(b64.get(), BIO_FLAGS_BASE64_NO_NL);
-    BIO_push(b64.get(), d);
+    BIO_push(b64.get(), mem.get());
     BIO_printf(b64.get(), "%s:%s", c->proxyUser().c_str(), c->proxyPass().c_str());
     (void)BIO_flush(b64.get());
     BIO_pop(b64.get());
-    BIO_printf(d, "\r\n");
+    char *buf = nullptr;
+    long size = BIO_get_mem_data(mem.get(), &buf);
+    return "Proxy-Authorization: Basic " + string(buf, size_t(size)) + "\r\n";
 }
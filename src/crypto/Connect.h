@@ -21,13 +21,13 @@
 
 #include "crypto/X509Cert.h"
 
+#include <chrono>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
 typedef struct bio_st BIO;
-typedef struct ssl_ctx_st SSL_CTX;
 
 namespace digidoc {
 
@@ -69,14 +69,25 @@ public:
     Result exec(std::initializer_list<std::pair<std::string,std::string>> headers = {},
         const unsigned char *data = nullptr, size_t size = 0);
 
+    static void clearPool();
+
 private:
     DISABLE_COPY(Connect);
 
-    void sendProxyAuth();
+    void connect();
+    bool read(std::string &data);
+    Result readResponse(bool headOnly);
+    bool send(const std::string &data);
+    static std::string proxyAuth();
 
     BIO *d = nullptr;
-    std::shared_ptr<SSL_CTX> ssl;
+    std::string host, port, hostname, method, key, request;
+    std::vector<X509Cert> certs;
+    std::chrono::steady_clock::time_point start;
+    int usessl = 0;
     int _timeout;
+    size_t received = 0;
+    bool reused = false, keepAlive = false;
 };
 
 }
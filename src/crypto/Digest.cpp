@@ -307,3 +307,44 @@ vector<unsigned char> Digest::result() const
 
     return *d;
 }
+
+
+
+/**
+ * Initializes digest calculator for every method in <code>uris</code>.
+ *
+ * @param uris digest method URIs.
+ * @throws Exception throws exception if digest method is not supported.
+ */
+MultiDigest::MultiDigest(const set<string> &uris)
+{
+    for(const string &uri: uris)
+        digests[uri].reset(new Digest(uri));
+}
+
+/**
+ * Add data for all digest calculations.
+ *
+ * @param data data to add for digest calculation.
+ * @param length length of the data.
+ * @throws Exception throws exception if update failed.
+ */
+void MultiDigest::update(const unsigned char *data, size_t length)
+{
+    for(const auto &digest: digests)
+        digest.second->update(data, length);
+}
+
+/**
+ * Calculates message digests.
+ *
+ * @return returns calculated digests by method URI.
+ * @throws Exception throws exception if digest calculation failed.
+ */
+map<string,vector<unsigned char>> MultiDigest::result() const
+{
+    map<string,vector<unsigned char>> result;
+    for(const auto &digest: digests)
+        result[digest.first] = digest.second->result();
+    return result;
+}
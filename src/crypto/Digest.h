@@ -21,6 +21,9 @@
 
 #include "../Exports.h"
 
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -79,4 +82,19 @@ namespace digidoc
           Private *d;
     };
 
+    /**
+     * Calculates digests with several algorithms over the same data in a single pass.
+     */
+    class MultiDigest
+    {
+      public:
+          MultiDigest(const std::set<std::string> &uris);
+          void update(const unsigned char *data, size_t length);
+          std::map<std::string,std::vector<unsigned char>> result() const;
+
+      private:
+          DISABLE_COPY(MultiDigest);
+          std::map<std::string,std::unique_ptr<Digest>> digests;
+    };
+
 }
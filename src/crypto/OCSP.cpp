@@ -22,12 +22,14 @@
 #include "Conf.h"
 #include "Container.h"
 #include "crypto/Connect.h"
+#include "crypto/Digest.h"
 #include "crypto/OpenSSLHelpers.h"
 #include "crypto/X509CertStore.h"
 #include "log.h"
 #include "util/DateTime.h"
 
 #include <algorithm>
+#include <mutex>
 
 #ifdef WIN32 //hack for win32 build
 #undef OCSP_REQUEST
@@ -109,7 +111,6 @@ OCSP::OCSP(const X509Cert &cert, const X509Cert &issuer, const vector<unsigned c
         (TMProfile ? "ASiC_E_BASELINE_LT_TM" : "ASiC_E_BASELINE_LT")).exec({
         {"Content-Type", "application/ocsp-request"},
         {"Accept", "application/ocsp-response"},
-        {"Connection", "Close"},
         {"Cache-Control", "no-cache"}
     }, i2d(req.get(), i2d_OCSP_REQUEST));
 
@@ -181,6 +182,77 @@ bool OCSP::compareResponderCert(const X509Cert &cert) const
     return false;
 }
 
+struct OCSP::Credentials
+{
+    unique_ptr<X509,decltype(&X509_free)> cert{nullptr, X509_free};
+    unique_ptr<EVP_PKEY,decltype(&EVP_PKEY_free)> key{nullptr, EVP_PKEY_free};
+};
+
+/**
+ * Parsed PKCS12 credentials are kept under salted digest of path and password,
+ * so that the password itself is not kept in memory.
+ */
+struct OCSP::CredentialsCache
+{
+    static CredentialsCache &instance()
+    {
+        static CredentialsCache cache;
+        return cache;
+    }
+
+    mutex m;
+    vector<unsigned char> salt, id;
+    shared_ptr<const Credentials> credentials;
+};
+
+/**
+ * Returns OCSP request signing certificate and key from PKCS12 file. Parsed credentials are
+ * kept until path or password changes, so that every request does not decrypt PKCS12 again.
+ */
+shared_ptr<const OCSP::Credentials> OCSP::pkcs12(const string &path, const string &pass)
+{
+    CredentialsCache &cache = CredentialsCache::instance();
+    lock_guard<mutex> lock(cache.m);
+    if(cache.salt.empty())
+    {
+        cache.salt.resize(32);
+        if(RAND_bytes(cache.salt.data(), int(cache.salt.size())) != 1)
+        {
+            cache.salt.clear();
+            THROW_OPENSSLEXCEPTION("Failed to generate random salt");
+        }
+    }
+    Digest calc(URI_SHA256);
+    calc.update(cache.salt);
+    // Path and password are separated by terminating null
+    calc.update((const unsigned char*)path.c_str(), path.size() + 1);
+    calc.update((const unsigned char*)pass.data(), pass.size());
+    vector<unsigned char> id = calc.result();
+    if(cache.credentials && cache.id == id)
+        return cache.credentials;
+
+    X509 *cert = nullptr;
+    EVP_PKEY *key = nullptr;
+    OpenSSL::parsePKCS12(path, pass, &key, &cert);
+    shared_ptr<Credentials> credentials = make_shared<Credentials>();
+    credentials->cert.reset(cert);
+    credentials->key.reset(key);
+    cache.id = move(id);
+    cache.credentials = credentials;
+    return credentials;
+}
+
+/**
+ * Releases cached PKCS12 credentials.
+ */
+void OCSP::clearCache()
+{
+    CredentialsCache &cache = CredentialsCache::instance();
+    lock_guard<mutex> lock(cache.m);
+    cache.id.clear();
+    cache.credentials.reset();
+}
+
 /**
  * Creates OCSP request to check the certificate <code>cert</code> validity.
  *
@@ -211,8 +283,7 @@ OCSP_REQUEST* OCSP::createRequest(OCSP_CERTID *certId, const vector<unsigned cha
 
     if(signRequest)
     {
-        X509* signCert;
-        EVP_PKEY* signKey;
+        shared_ptr<const Credentials> credentials;
 #ifdef USE_KEYCHAIN
         if(SecIdentityRef identity = SecIdentityCopyPreferred(CFSTR("ocsp.sk.ee"), nullptr, nullptr))
         {
@@ -228,8 +299,9 @@ OCSP_REQUEST* OCSP::createRequest(OCSP_CERTID *certId, const vector<unsigned cha
             CFRelease(certref);
             if(!certdata)
                 THROW("Failed to read PKCS12 certificate");
+            shared_ptr<Credentials> keychain = make_shared<Credentials>();
             const unsigned char *p = CFDataGetBytePtr(certdata);
-            signCert = d2i_X509(nullptr, &p, CFDataGetLength(certdata));
+            keychain->cert.reset(d2i_X509(nullptr, &p, CFDataGetLength(certdata)));
             CFRelease(certdata);
 
             CFDataRef keydata = nullptr;
@@ -241,30 +313,29 @@ OCSP_REQUEST* OCSP::createRequest(OCSP_CERTID *certId, const vector<unsigned cha
             if(!keydata)
                 THROW("Failed to read PKCS12 key");
             SCOPE(BIO, bio, BIO_new_mem_buf((void*)CFDataGetBytePtr(keydata), int(CFDataGetLength(keydata))));
-            signKey = d2i_PKCS8PrivateKey_bio(bio.get(), nullptr, [](char *buf, int bufsiz, int, void *) -> int {
+            keychain->key.reset(d2i_PKCS8PrivateKey_bio(bio.get(), nullptr, [](char *buf, int bufsiz, int, void *) -> int {
                 static const char password[] = "pass";
                 int res = strlen(password);
                 if (res > bufsiz)
                         res = bufsiz;
                 memcpy(buf, password, size_t(res));
                 return res;
-            }, nullptr);
+            }, nullptr));
             CFRelease(keydata);
+            credentials = keychain;
         } else {
 #endif
         Conf *c = Conf::instance();
-        OpenSSL::parsePKCS12(c->PKCS12Cert(), c->PKCS12Pass(), &signKey, &signCert);
+        credentials = pkcs12(c->PKCS12Cert(), c->PKCS12Pass());
 #ifdef USE_KEYCHAIN
         }
 #endif
-        if(!signCert)
+        if(!credentials->cert)
             THROW_OPENSSLEXCEPTION("Failed to parse PKCS12 certificate");
-        if(!signKey)
+        if(!credentials->key)
             THROW_OPENSSLEXCEPTION("Failed to parse PKCS12 key");
-        if(!OCSP_request_sign(req.get(), signCert, signKey, EVP_sha256(), nullptr, 0))
+        if(!OCSP_request_sign(req.get(), credentials->cert.get(), credentials->key.get(), EVP_sha256(), nullptr, 0))
             THROW_OPENSSLEXCEPTION("Failed to sign OCSP request.");
-        X509_free(signCert);
-        EVP_PKEY_free(signKey);
     }
 
     return req.release();
@@ -313,9 +384,7 @@ void OCSP::verifyResponse(const X509Cert &cert) const
 
     time_t t = util::date::ASN1TimeToTime_t(producedAt());
     SCOPE(X509_STORE, store, X509CertStore::createStore(X509CertStore::OCSP, &t));
-    STACK_OF(X509) *stack = sk_X509_new_null();
-    for(const X509Cert &i: X509CertStore::instance()->certs(X509CertStore::OCSP))
-        sk_X509_push(stack, i.handle());
+    shared_ptr<STACK_OF(X509)> stack = X509CertStore::instance()->certStack(X509CertStore::OCSP);
     OpenSSLException(); // Clear errors
     //OCSP_TRUSTOTHER - enables OCSP_NOVERIFY
     //OCSP_NOSIGS - does not verify ocsp signatures
@@ -323,8 +392,7 @@ void OCSP::verifyResponse(const X509Cert &cert) const
     //OCSP_NOCHECKS - cancel futurer responder issuer checks and trust bits
     //OCSP_NOEXPLICIT - returns 0 by mistake
     //all checks enabled fails trust bit check, cant use OCSP_NOEXPLICIT instead using OCSP_NOCHECKS
-    int result = OCSP_basic_verify(basic.get(), stack, store.get(), OCSP_NOCHECKS);
-    sk_X509_free(stack);
+    int result = OCSP_basic_verify(basic.get(), stack.get(), store.get(), OCSP_NOCHECKS);
     if(result <= 0)
         THROW_OPENSSLEXCEPTION("Failed to verify OCSP response.");
 
@@ -49,7 +49,13 @@ namespace digidoc
           std::vector<unsigned char> toDer() const;
           void verifyResponse(const X509Cert &cert) const;
 
+          static void clearCache();
+
       private:
+          struct Credentials;
+          struct CredentialsCache;
+
+          static std::shared_ptr<const Credentials> pkcs12(const std::string &path, const std::string &pass);
           bool compareResponderCert(const X509Cert &cert) const;
           OCSP_REQUEST* createRequest(OCSP_CERTID *certId, const std::vector<unsigned char> &nonce, bool signRequest);
 
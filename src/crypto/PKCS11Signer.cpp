@@ -30,6 +30,9 @@
 #include <openssl/evp.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
 #ifdef _WIN32
 #include <Windows.h>
 #else
@@ -43,6 +46,13 @@ using namespace std;
 class PKCS11Signer::Private
 {
 public:
+    struct Key
+    {
+        CK_OBJECT_HANDLE handle;
+        CK_KEY_TYPE type;
+        bool alwaysAuthenticate;
+    };
+
     vector<CK_BYTE> attribute(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj, CK_ATTRIBUTE_TYPE type) const;
     vector<CK_OBJECT_HANDLE> findObject(CK_SESSION_HANDLE session, CK_OBJECT_CLASS cls, const vector<CK_BYTE> &id = {}) const;
 
@@ -85,6 +95,28 @@ public:
         std::vector<CK_BYTE> id;
     } sign = SignSlot({ X509Cert(), 0, {} });
     string pin;
+
+    // Authenticated session to slot holding signing key and keys found in it,
+    // reused between signatures when enabled with setMaxSessions
+    struct Session
+    {
+        SignSlot slot;
+        CK_SESSION_HANDLE handle;
+        map<vector<CK_BYTE>,Key> keys;
+    };
+    unique_ptr<Session> acquire(const PKCS11Signer *signer, bool &opened, bool forceLogin);
+    void closeSession(Session &session);
+    Key findKey(Session &session);
+    void login(Session &session, CK_USER_TYPE type, const CK_TOKEN_INFO &token, const PKCS11Signer *signer);
+    void openSession(Session &session, const PKCS11Signer *signer, bool forceLogin);
+    void release(unique_ptr<Session> session);
+
+    vector<SignSlot> slots;
+    vector<unique_ptr<Session>> idle;
+    size_t sessions = 0, maxSessions = 1, nextSlot = 0;
+    bool threadSafe = false, reuse = false;
+    mutex sessionLock, loginLock;
+    condition_variable sessionReleased;
 };
 
 vector<CK_BYTE> PKCS11Signer::Private::attribute(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj, CK_ATTRIBUTE_TYPE type) const
@@ -121,6 +153,164 @@ vector<CK_OBJECT_HANDLE> PKCS11Signer::Private::findObject(CK_SESSION_HANDLE ses
     return result;
 }
 
+/**
+ * Takes idle session from pool or opens new one, when less than maximum sessions are in use.
+ * New sessions are spread round robin over slots holding signing certificate.
+ * Waits until some session is released when all sessions are in use.
+ * With <code>forceLogin</code> idle session is reopened and login is not skipped.
+ */
+unique_ptr<PKCS11Signer::Private::Session> PKCS11Signer::Private::acquire(const PKCS11Signer *signer, bool &opened, bool forceLogin)
+{
+    unique_lock<mutex> lock(sessionLock);
+    size_t limit = threadSafe && reuse ? maxSessions : 1;
+    sessionReleased.wait(lock, [&]{ return !idle.empty() || sessions < limit; });
+    unique_ptr<Session> session;
+    if(!idle.empty())
+    {
+        session = move(idle.back());
+        idle.pop_back();
+        if(!forceLogin)
+        {
+            opened = false;
+            return session;
+        }
+        closeSession(*session);
+    }
+    else
+    {
+        session.reset(new Session{ slots[nextSlot++ % slots.size()], CK_INVALID_HANDLE, {} });
+        ++sessions;
+    }
+    lock.unlock();
+    try {
+        openSession(*session, signer, forceLogin);
+    } catch(...) {
+        release(move(session));
+        throw;
+    }
+    opened = true;
+    return session;
+}
+
+void PKCS11Signer::Private::closeSession(Session &session)
+{
+    if(session.handle != CK_INVALID_HANDLE)
+        f->C_CloseSession(session.handle);
+    session.handle = CK_INVALID_HANDLE;
+    session.keys.clear();
+}
+
+/**
+ * Returns private key matching certificate ID, handles are cached for the lifetime of session.
+ */
+PKCS11Signer::Private::Key PKCS11Signer::Private::findKey(Session &session)
+{
+    auto it = session.keys.find(session.slot.id);
+    if(it != session.keys.cend())
+        return it->second;
+
+    vector<CK_OBJECT_HANDLE> key = findObject(session.handle, CKO_PRIVATE_KEY, session.slot.id);
+    if(key.size() != 1)
+        THROW("Could not get key that matches selected certificate.");
+
+    CK_KEY_TYPE keyType = CKK_RSA;
+    CK_ATTRIBUTE attribute = { CKA_KEY_TYPE, &keyType, sizeof(keyType) };
+    f->C_GetAttributeValue(session.handle, key[0], &attribute, 1);
+    CK_BBOOL alwaysAuthenticate = CK_FALSE;
+    attribute = { CKA_ALWAYS_AUTHENTICATE, &alwaysAuthenticate, sizeof(alwaysAuthenticate) };
+    f->C_GetAttributeValue(session.handle, key[0], &attribute, 1);
+    return session.keys[session.slot.id] = { key[0], keyType, alwaysAuthenticate == CK_TRUE };
+}
+
+/**
+ * Logs in to session, PIN is acquired by calling <code>pin</code> or entered on PIN pad.
+ */
+void PKCS11Signer::Private::login(Session &session, CK_USER_TYPE type, const CK_TOKEN_INFO &token, const PKCS11Signer *signer)
+{
+    CK_RV rv = CKR_OK;
+    if(token.flags & CKF_PROTECTED_AUTHENTICATION_PATH)
+        rv = f->C_Login(session.handle, type, nullptr, 0);
+    else
+    {
+        string _pin = signer->pin(session.slot.certificate);
+        rv = f->C_Login(session.handle, type, CK_BYTE_PTR(_pin.c_str()), CK_ULONG(_pin.size()));
+    }
+    switch(rv)
+    {
+    case CKR_OK: break;
+    case CKR_USER_ALREADY_LOGGED_IN: break;
+    case CKR_CANCEL:
+    case CKR_FUNCTION_CANCELED:
+    {
+        Exception e(EXCEPTION_PARAMS("PIN acquisition canceled."));
+        e.setCode(Exception::PINCanceled);
+        throw e;
+    }
+    case CKR_PIN_INCORRECT:
+    {
+        Exception e(EXCEPTION_PARAMS("PIN Incorrect"));
+        e.setCode(Exception::PINIncorrect);
+        throw e;
+    }
+    case CKR_PIN_LOCKED:
+    {
+        Exception e(EXCEPTION_PARAMS("PIN Locked"));
+        e.setCode(Exception::PINLocked);
+        throw e;
+    }
+    default:
+        Exception e(EXCEPTION_PARAMS("Failed to login to token '%s': %lu", token.label, rv));
+        e.setCode(Exception::PINFailed);
+        throw e;
+    }
+}
+
+/**
+ * Opens session to slot and logs in if required. Login is skipped only when session reuse
+ * is enabled and token is logged in already by another session.
+ */
+void PKCS11Signer::Private::openSession(Session &session, const PKCS11Signer *signer, bool forceLogin)
+{
+    lock_guard<mutex> lock(loginLock);
+    CK_TOKEN_INFO token;
+    if(f->C_GetTokenInfo(session.slot.slot, &token) != CKR_OK ||
+       f->C_OpenSession(session.slot.slot, CKF_SERIAL_SESSION, nullptr, nullptr, &session.handle) != CKR_OK)
+    {
+        session.handle = CK_INVALID_HANDLE;
+        THROW("Signing slot or certificate are not selected.");
+    }
+
+    if(!(token.flags & CKF_LOGIN_REQUIRED))
+        return;
+
+    CK_SESSION_INFO info;
+    if(reuse && !forceLogin && f->C_GetSessionInfo(session.handle, &info) == CKR_OK &&
+        (info.state == CKS_RO_USER_FUNCTIONS || info.state == CKS_RW_USER_FUNCTIONS))
+        return;
+
+    try {
+        login(session, CKU_USER, token, signer);
+    } catch(...) {
+        closeSession(session);
+        throw;
+    }
+}
+
+/**
+ * Returns session to pool, closed sessions are dropped and replaced on next acquire.
+ */
+void PKCS11Signer::Private::release(unique_ptr<Session> session)
+{
+    lock_guard<mutex> lock(sessionLock);
+    // Closing last session logs out, so next signature asks PIN again
+    if(!reuse)
+        closeSession(*session);
+    if(session->handle != CK_INVALID_HANDLE)
+        idle.push_back(move(session));
+    else
+        --sessions;
+    sessionReleased.notify_one();
+}
 
 /**
  * @class digidoc::PKCS11Signer
@@ -160,9 +350,16 @@ PKCS11Signer::PKCS11Signer(const string &driver)
         THROW("Failed to load driver for PKCS #11 engine: %s.", load.c_str());
 
     CK_C_GetFunctionList l = CK_C_GetFunctionList(d->resolve("C_GetFunctionList"));
-    if(!l ||
-        l(&d->f) != CKR_OK ||
-        d->f->C_Initialize(nullptr) != CKR_OK)
+    if(!l || l(&d->f) != CKR_OK)
+        THROW("Failed to load driver for PKCS #11 engine: %s.", load.c_str());
+
+    // Request OS locking, so that sessions can be used from multiple threads
+    CK_C_INITIALIZE_ARGS args = { nullptr, nullptr, nullptr, nullptr, CKF_OS_LOCKING_OK, nullptr };
+    CK_RV rv = d->f->C_Initialize(&args);
+    d->threadSafe = rv == CKR_OK;
+    if(rv == CKR_CANT_LOCK)
+        rv = d->f->C_Initialize(nullptr);
+    if(rv != CKR_OK)
         THROW("Failed to load driver for PKCS #11 engine: %s.", load.c_str());
 }
 
@@ -173,6 +370,9 @@ PKCS11Signer::~PKCS11Signer()
 {
     if(d->f)
     {
+        for(unique_ptr<Private::Session> &session: d->idle)
+            d->closeSession(*session);
+        d->idle.clear();
         d->f->C_Finalize(nullptr);
         d->f = nullptr;
         d->unload();
@@ -195,6 +395,7 @@ PKCS11Signer::~PKCS11Signer()
 X509Cert PKCS11Signer::cert() const
 {
     DEBUG("PKCS11Signer::getCert()");
+    lock_guard<mutex> lock(d->sessionLock);
 
     // If certificate is already selected return it.
     if(!!d->sign.certificate)
@@ -225,7 +426,9 @@ X509Cert PKCS11Signer::cert() const
             if(!x509.isValid() || find(usage.cbegin(), usage.cend(), X509Cert::NonRepudiation) == usage.cend() || x509.isCA())
                 continue;
             certSlotMapping.push_back({ x509, slot, d->attribute(session, obj, CKA_ID) });
-            certificates.push_back(x509);
+            // HSM-s may hold same certificate in multiple slots
+            if(find(certificates.cbegin(), certificates.cend(), x509) == certificates.cend())
+                certificates.push_back(x509);
         }
     }
     if(session)
@@ -239,11 +442,14 @@ X509Cert PKCS11Signer::cert() const
     if(!selectedCert)
         THROW("No certificate selected.");
 
-    // Find the corresponding slot and PKCS11 certificate struct.
+    // Find the corresponding slots and PKCS11 certificate struct.
     for(const Private::SignSlot &slot: certSlotMapping)
     {
-        if(slot.certificate == selectedCert)
+        if(slot.certificate != selectedCert)
+            continue;
+        if(!d->sign.certificate)
             d->sign = slot;
+        d->slots.push_back(slot);
     }
 
     if(!d->sign.certificate)
@@ -295,11 +501,32 @@ void PKCS11Signer::setPin(const string &pin)
     d->pin = pin;
 }
 
+/**
+ * Enables reusing logged in sessions between signatures and sets maximum number of sessions
+ * used for concurrent <code>sign</code> calls. Sessions are spread over all slots holding
+ * selected certificate, calls exceeding the limit wait for free session. Failing session
+ * is closed without affecting others. Driver must support OS locking, otherwise single
+ * session is used.
+ *
+ * By default session is closed after each signature and PIN is acquired again for next one.
+ * When reuse is enabled, <code>pin</code> is called only when token is not logged in.
+ *
+ * @param sessions maximum number of sessions
+ */
+void PKCS11Signer::setMaxSessions(unsigned int sessions)
+{
+    lock_guard<mutex> lock(d->sessionLock);
+    d->maxSessions = max(1U, sessions);
+    d->reuse = true;
+}
+
 /**
  * @brief Reimplemented parent class method <code>digidoc::Signer::sign</code>
  *
  * Signs the digest provided using the selected certificate. If the certificate needs PIN,
- * the PIN is acquired by calling the callback function <code>pin</code>.
+ * the PIN is acquired by calling the callback function <code>pin</code>. When session reuse is
+ * enabled with <code>setMaxSessions</code>, session stays logged in for following signatures and
+ * is reopened when token has closed it or requires new login.
  *
  * @param digest digest, which is being signed.
  * @return signature memory for the signature that is created.
@@ -313,104 +540,96 @@ vector<unsigned char> PKCS11Signer::sign(const string &method, const vector<unsi
     if(!d->sign.certificate)
         THROW("Signing slot or certificate are not selected.");
 
-    // Login if required.
-    CK_TOKEN_INFO token;
-    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
-    if(d->f->C_GetTokenInfo(d->sign.slot, &token) != CKR_OK ||
-       d->f->C_OpenSession(d->sign.slot, CKF_SERIAL_SESSION, nullptr, nullptr, &session) != CKR_OK)
-        THROW("Signing slot or certificate are not selected.");
-
-    CK_RV rv = CKR_OK;
-    if(token.flags & CKF_LOGIN_REQUIRED)
+    bool forceLogin = false;
+    while(true)
     {
-        if(token.flags & CKF_PROTECTED_AUTHENTICATION_PATH)
-            rv = d->f->C_Login(session, CKU_USER, nullptr, 0);
-        else
-        {
-            string _pin = pin(d->sign.certificate);
-            rv = d->f->C_Login(session, CKU_USER, CK_BYTE_PTR(_pin.c_str()), CK_ULONG(_pin.size()));
+        // Login if required.
+        bool opened = false;
+        unique_ptr<Private::Session> session = d->acquire(this, opened, forceLogin);
+        Private::Key key = { CK_INVALID_HANDLE, CKK_RSA, false };
+        CK_RSA_PKCS_PSS_PARAMS pssParams = { CKM_SHA_1, CKG_MGF1_SHA1, 0 };
+        CK_MECHANISM mech = { CKM_RSA_PKCS, nullptr, 0 };
+        vector<CK_BYTE> data = digest;
+        try {
+            key = d->findKey(*session);
+
+            // Sign the digest.
+            if(key.type == CKK_ECDSA)
+                mech.mechanism = CKM_ECDSA;
+            if(Digest::isRsaPssUri(method)) {
+                mech.mechanism = CKM_RSA_PKCS_PSS;
+                mech.pParameter = &pssParams;
+                mech.ulParameterLen = sizeof(CK_RSA_PKCS_PSS_PARAMS);
+                int nid = Digest::toMethod(method);
+                switch(nid)
+                {
+                case NID_sha224:
+                    pssParams.hashAlg = CKM_SHA224;
+                    pssParams.mgf = CKG_MGF1_SHA224;
+                    break;
+                case NID_sha256:
+                    pssParams.hashAlg = CKM_SHA256;
+                    pssParams.mgf = CKG_MGF1_SHA256;
+                    break;
+                case NID_sha384:
+                    pssParams.hashAlg = CKM_SHA384;
+                    pssParams.mgf = CKG_MGF1_SHA384;
+                    break;
+                case NID_sha512:
+                    pssParams.hashAlg = CKM_SHA512;
+                    pssParams.mgf = CKG_MGF1_SHA512;
+                    break;
+                default: break;
+                }
+                pssParams.sLen = EVP_MD_size(EVP_get_digestbynid(nid));
+            }
+            else if(key.type == CKK_RSA)
+                data = Digest::addDigestInfo(digest, method);
+        } catch(...) {
+            d->closeSession(*session);
+            d->release(move(session));
+            throw;
         }
-        switch(rv)
-        {
-        case CKR_OK: break;
-        case CKR_USER_ALREADY_LOGGED_IN: break;
-        case CKR_CANCEL:
-        case CKR_FUNCTION_CANCELED:
+
+        CK_ULONG size = 0;
+        vector<unsigned char> signature;
+        CK_RV rv = d->f->C_SignInit(session->handle, &mech, key.handle);
+        if(rv == CKR_OK && key.alwaysAuthenticate)
         {
-            Exception e(EXCEPTION_PARAMS("PIN acquisition canceled."));
-            e.setCode(Exception::PINCanceled);
-            throw e;
+            // Key requires PIN for each signature
+            try {
+                CK_TOKEN_INFO token;
+                if(d->f->C_GetTokenInfo(session->slot.slot, &token) != CKR_OK)
+                    THROW("Signing slot or certificate are not selected.");
+                d->login(*session, CKU_CONTEXT_SPECIFIC, token, this);
+            } catch(...) {
+                d->closeSession(*session);
+                d->release(move(session));
+                throw;
+            }
         }
-        case CKR_PIN_INCORRECT:
+        if(rv == CKR_OK)
+            rv = d->f->C_Sign(session->handle, data.data(), CK_ULONG(data.size()), nullptr, &size);
+        if(rv == CKR_OK)
         {
-            Exception e(EXCEPTION_PARAMS("PIN Incorrect"));
-            e.setCode(Exception::PINIncorrect);
-            throw e;
+            signature.resize(size);
+            rv = d->f->C_Sign(session->handle, data.data(), CK_ULONG(data.size()), signature.data(), CK_ULONG_PTR(&size));
         }
-        case CKR_PIN_LOCKED:
+        if(rv != CKR_OK)
+            d->closeSession(*session);
+        d->release(move(session));
+        if(rv == CKR_OK)
         {
-            Exception e(EXCEPTION_PARAMS("PIN Locked"));
-            e.setCode(Exception::PINLocked);
-            throw e;
-        }
-        default:
-            Exception e(EXCEPTION_PARAMS("Failed to login to token '%s': %lu", token.label, rv));
-            e.setCode(Exception::PINFailed);
-            throw e;
+            signature.resize(size);
+            return signature;
         }
-    }
-
-    vector<CK_OBJECT_HANDLE> key = d->findObject(session, CKO_PRIVATE_KEY, d->sign.id);
-    if(key.size() != 1)
-        THROW("Could not get key that matches selected certificate.");
 
-    // Sign the digest.
-    CK_KEY_TYPE keyType = CKK_RSA;
-    CK_ATTRIBUTE attribute = { CKA_KEY_TYPE, &keyType, sizeof(keyType) };
-    d->f->C_GetAttributeValue(session, key[0], &attribute, 1);
-
-    CK_RSA_PKCS_PSS_PARAMS pssParams = { CKM_SHA_1, CKG_MGF1_SHA1, 0 };
-    CK_MECHANISM mech = { keyType == CKK_ECDSA ? CKM_ECDSA : CKM_RSA_PKCS, nullptr, 0 };
-    vector<CK_BYTE> data = digest;
-    if(Digest::isRsaPssUri(method)) {
-        mech.mechanism = CKM_RSA_PKCS_PSS;
-        mech.pParameter = &pssParams;
-        mech.ulParameterLen = sizeof(CK_RSA_PKCS_PSS_PARAMS);
-        int nid = Digest::toMethod(method);
-        switch(nid)
-        {
-        case NID_sha224:
-            pssParams.hashAlg = CKM_SHA224;
-            pssParams.mgf = CKG_MGF1_SHA224;
-            break;
-        case NID_sha256:
-            pssParams.hashAlg = CKM_SHA256;
-            pssParams.mgf = CKG_MGF1_SHA256;
-            break;
-        case NID_sha384:
-            pssParams.hashAlg = CKM_SHA384;
-            pssParams.mgf = CKG_MGF1_SHA384;
-            break;
-        case NID_sha512:
-            pssParams.hashAlg = CKM_SHA512;
-            pssParams.mgf = CKG_MGF1_SHA512;
-            break;
-        default: break;
-        }
-        pssParams.sLen = EVP_MD_size(EVP_get_digestbynid(nid));
+        // Reused session may be closed by token or token may require new login,
+        // which must not be skipped because of other sessions
+        if(opened || (rv != CKR_SESSION_HANDLE_INVALID && rv != CKR_SESSION_CLOSED &&
+                rv != CKR_USER_NOT_LOGGED_IN && rv != CKR_KEY_HANDLE_INVALID && rv != CKR_OBJECT_HANDLE_INVALID))
+            THROW("Failed to sign digest");
+        forceLogin = rv == CKR_USER_NOT_LOGGED_IN;
+        DEBUG("PKCS11 session is not valid (%lu), opening new session", rv);
     }
-    else if(keyType == CKK_RSA)
-        data = Digest::addDigestInfo(digest, method);
-    if(d->f->C_SignInit(session, &mech, key[0]) != CKR_OK)
-        THROW("Failed to sign digest");
-
-    CK_ULONG size = 0;
-    if(d->f->C_Sign(session, data.data(), CK_ULONG(data.size()), nullptr, &size) != CKR_OK)
-        THROW("Failed to sign digest");
-
-    vector<unsigned char> signature(size);
-    rv = d->f->C_Sign(session, data.data(), CK_ULONG(data.size()), signature.data(), CK_ULONG_PTR(&size));
-    if(rv != CKR_OK)
-        THROW("Failed to sign digest");
-    return signature;
 }
@@ -31,6 +31,7 @@ namespace digidoc
           ~PKCS11Signer() override;
 
           void setPin(const std::string &pin);
+          void setMaxSessions(unsigned int sessions);
 
       protected:
           virtual std::string pin(const X509Cert &certificate) const;
@@ -96,7 +96,6 @@ TS::TS(const string &url, const Digest &digest, const string &useragent)
     Connect::Result result = Connect(url, "POST", 0, useragent).exec({
         {"Content-Type", "application/timestamp-query"},
         {"Accept", "application/timestamp-reply"},
-        {"Connection", "Close"},
         {"Cache-Control", "no-cache"}
     }, i2d(req.get(), i2d_TS_REQ));
 
@@ -242,8 +241,11 @@ TS_TST_INFO* TS::tstInfo() const
 
 void TS::verify(const Digest &digest)
 {
-    vector<unsigned char> data = digest.result();
+    verify(digest.result());
+}
 
+void TS::verify(const vector<unsigned char> &data)
+{
     time_t t = util::date::ASN1TimeToTime_t(time());
     SCOPE(X509_STORE, store, X509CertStore::createStore(X509CertStore::TSA, &t));
     X509CertStore::instance()->activate(cert().issuerName("C"));
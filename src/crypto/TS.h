@@ -42,6 +42,7 @@ public:
     std::string serial() const;
     std::string time() const;
     void verify(const Digest &digest);
+    void verify(const std::vector<unsigned char> &digest);
 
     operator std::vector<unsigned char>() const;
 
@@ -31,7 +31,12 @@
 #include <openssl/ssl.h>
 
 #include <algorithm>
+#include <condition_variable>
 #include <iomanip>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
 
 using namespace digidoc;
 using namespace std;
@@ -75,14 +80,180 @@ const set<string> X509CertStore::OCSP = {
     "http://uri.etsi.org/TrstSvc/Svctype/Certstatus/OCSP/QC",
 };
 
-class X509CertStore::Private: public vector<TSL::Service> {
+namespace
+{
+/**
+ * Background thread refreshing TSL lists periodically
+ */
+class Refresher
+{
+public:
+    ~Refresher() { stop(); }
+
+    template<class F>
+    void start(int interval, F update)
+    {
+        lock_guard<mutex> lock(m);
+        if(worker.joinable())
+            return;
+        stopped = false;
+        worker = thread([=]{
+            unique_lock<mutex> lock(m);
+            while(!cv.wait_for(lock, chrono::seconds(interval), [this]{ return stopped; }))
+            {
+                lock.unlock();
+                update();
+                lock.lock();
+            }
+        });
+    }
+
+    void stop()
+    {
+        {
+            lock_guard<mutex> lock(m);
+            stopped = true;
+        }
+        cv.notify_all();
+        if(!worker.joinable())
+            return;
+        if(worker.get_id() == this_thread::get_id())
+            worker.detach();
+        else
+            worker.join();
+    }
+
+private:
+    mutex m;
+    condition_variable cv;
+    thread worker;
+    bool stopped = false;
+};
+
+Refresher refresher;
+}
+
+/**
+ * Immutable TSL service list with lookup indexes built once at load time.
+ * Candidates are kept in service order, so lookups return the same service as a linear scan.
+ */
+class X509CertStore::Index {
 public:
+    struct Entry { size_t service; const X509Cert *cert; };
+    using Entries = vector<Entry>;
+
+    explicit Index(vector<TSL::Service> &&list)
+        : services(move(list))
+    {
+        for(size_t i = 0; i < services.size(); ++i)
+        {
+            for(const X509Cert &cert: services[i].certs)
+            {
+                Entry entry{i, &cert};
+                byCert[cert].push_back(entry);
+                bySubject[X509_NAME_hash(X509_get_subject_name(cert.handle()))].push_back(entry);
+                SCOPE(ASN1_OCTET_STRING, skid, X509_get_ext_d2i(cert.handle(), NID_subject_key_identifier, nullptr, nullptr));
+                if(skid)
+                    bySKID[vector<unsigned char>(skid->data, skid->data + skid->length)].push_back(entry);
+            }
+        }
+        for(const set<string> &type: {CA, OCSP, TSA})
+        {
+            STACK_OF(X509) *stack = sk_X509_new_null();
+            for(const TSL::Service &s: services)
+            {
+                if(type.find(s.type) == type.cend())
+                    continue;
+                for(const X509Cert &cert: s.certs)
+                    sk_X509_push(stack, cert.handle());
+            }
+            stacks[type] = stack;
+        }
+    }
+
+    ~Index()
+    {
+        for(const pair<const set<string>,STACK_OF(X509)*> &stack: stacks)
+            sk_X509_free(stack.second);
+    }
+
+    /**
+     * Returns certificates in store equal to <code>cert</code>.
+     */
+    Entries find(X509 *cert) const
+    {
+        map<vector<unsigned char>,Entries>::const_iterator i = byCert.find(X509Cert(cert));
+        return i == byCert.cend() ? Entries() : i->second;
+    }
+
+    /**
+     * Returns issuer candidates by Authority Key Identifier or by issuer name,
+     * when certificate does not have key identifier.
+     */
+    Entries issuers(X509 *cert, const AUTHORITY_KEYID *akid) const
+    {
+        if(akid && akid->keyid)
+        {
+            map<vector<unsigned char>,Entries>::const_iterator i = bySKID.find(
+                vector<unsigned char>(akid->keyid->data, akid->keyid->data + akid->keyid->length));
+            return i == bySKID.cend() ? Entries() : i->second;
+        }
+        Entries result;
+        X509_NAME *issuer = X509_get_issuer_name(cert);
+        map<unsigned long,Entries>::const_iterator i = bySubject.find(X509_NAME_hash(issuer));
+        if(i == bySubject.cend())
+            return result;
+        copy_if(i->second.cbegin(), i->second.cend(), back_inserter(result), [&](const Entry &e) {
+            return X509_NAME_cmp(X509_get_subject_name(e.cert->handle()), issuer) == 0;
+        });
+        return result;
+    }
+
+    const vector<TSL::Service> services;
+    // Certificates by service type, handles are owned by services
+    map<set<string>,STACK_OF(X509)*> stacks;
+
+private:
+    DISABLE_COPY(Index);
+
+    map<vector<unsigned char>,Entries> byCert, bySKID;
+    map<unsigned long,Entries> bySubject;
+};
+
+/**
+ * Certificate index is immutable snapshot, readers keep their copy of the pointer while
+ * iterating and update replaces the pointer, so validation can run on several threads.
+ */
+class X509CertStore::Private {
+public:
+    using Services = shared_ptr<const Index>;
+
+    Services services() const
+    {
+        lock_guard<mutex> lock(m);
+        return list;
+    }
+
     void update()
     {
-        vector<TSL::Service> list = TSL::parse(CONF(TSLTimeOut));
-        swap(list);
-        INFO("Loaded %lu certificates into TSL certificate store.", (unsigned long)size());
+        Services services = make_shared<Index>(TSL::parse(CONF(TSLTimeOut)));
+        INFO("Loaded %lu certificates into TSL certificate store.", (unsigned long)services->services.size());
+        lock_guard<mutex> lock(m);
+        list = services;
     }
+
+    // Snapshot used by verify callback, set on X509_STORE_CTX by verify()
+    static int index()
+    {
+        static const int idx = X509_STORE_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return idx;
+    }
+
+    Services list;
+    // Trust is decided by validate callback, so one store without certificates is shared
+    unique_ptr<X509_STORE,decltype(&X509_STORE_free)> caStore{createStore(CA), X509_STORE_free};
+    mutable mutex m;
+    mutex updateLock;
 };
 
 /**
@@ -104,15 +275,49 @@ X509CertStore::X509CertStore()
  */
 X509CertStore::~X509CertStore()
 {
+    refresher.stop();
     delete d;
 }
 
 void X509CertStore::activate(const string &territory) const
 {
+    // Callers seeing unchanged list must wait until update started by other caller is finished
+    lock_guard<mutex> lock(d->updateLock);
     if(TSL::activate(territory))
         d->update();
 }
 
+/**
+ * Starts background TSL refresh when refresh interval is configured. Called by
+ * digidoc::initialize(), so that refresh is restarted after digidoc::terminate().
+ */
+void X509CertStore::startRefresh()
+{
+    int interval = CONF(TSLRefreshInterval);
+    if(interval <= 0)
+        return;
+    Private *d = instance()->d;
+    refresher.start(interval, [d]{
+        try {
+            // Lists are parsed and validated here, readers keep using previous snapshot until swap
+            lock_guard<mutex> lock(d->updateLock);
+            d->update();
+        } catch(const Exception &e) {
+            WARN("Failed to refresh TSL: %s", e.msg().c_str());
+        } catch(...) {
+            WARN("Failed to refresh TSL");
+        }
+    });
+}
+
+/**
+ * Stops background TSL refresh, called before configuration is released.
+ */
+void X509CertStore::stopRefresh()
+{
+    refresher.stop();
+}
+
 /**
  * @return returns the X.509 certificate store implementation.
  */
@@ -131,7 +336,8 @@ X509CertStore* X509CertStore::instance()
 vector<X509Cert> X509CertStore::certs(const set<string> &type) const
 {
     vector<X509Cert> certs;
-    for(const TSL::Service &s: *d)
+    Private::Services services = d->services();
+    for(const TSL::Service &s: services->services)
     {
         if(type.find(s.type) != type.cend())
             certs.insert(certs.end(), s.certs.cbegin(), s.certs.cend());
@@ -139,6 +345,19 @@ vector<X509Cert> X509CertStore::certs(const set<string> &type) const
     return certs;
 }
 
+/**
+ * Returns certificates of <code>type</code> services as OpenSSL stack.
+ * Stack is shared with current TSL snapshot and stays valid while returned pointer exists.
+ */
+shared_ptr<STACK_OF(X509)> X509CertStore::certStack(const set<string> &type) const
+{
+    Private::Services services = d->services();
+    map<set<string>,STACK_OF(X509)*>::const_iterator i = services->stacks.find(type);
+    if(i == services->stacks.cend())
+        return shared_ptr<STACK_OF(X509)>(sk_X509_new_null(), [](STACK_OF(X509) *stack) { sk_X509_free(stack); });
+    return shared_ptr<STACK_OF(X509)>(services, i->second);
+}
+
 /**
  * Searches certificate by subject and returns a copy of it if found.
  * If not found returns <code>NULL</code>.
@@ -152,24 +371,11 @@ X509Cert X509CertStore::findIssuer(const X509Cert &cert, const set<string> &type
 {
     activate(cert.issuerName("C"));
     SCOPE(AUTHORITY_KEYID, akid, X509_get_ext_d2i(cert.handle(), NID_authority_key_identifier, nullptr, nullptr));
-    for(const TSL::Service &s: *d)
+    Private::Services services = d->services();
+    for(const Index::Entry &e: services->issuers(cert.handle(), akid.get()))
     {
-        if(type.find(s.type) == type.cend())
-            continue;
-        for(const X509Cert &i: s.certs)
-        {
-            if(!akid || !akid->keyid)
-            {
-                if(X509_NAME_cmp(X509_get_subject_name(i.handle()), X509_get_issuer_name(cert.handle())))
-                    return i;
-            }
-            else
-            {
-                SCOPE(ASN1_OCTET_STRING, skid, X509_get_ext_d2i(i.handle(), NID_subject_key_identifier, nullptr, nullptr));
-                if(skid && ASN1_OCTET_STRING_cmp(akid->keyid, skid.get()) == 0)
-                    return i;
-            }
-        }
+        if(type.find(services->services[e.service].type) != type.cend())
+            return *e.cert;
     }
     return X509Cert();
 }
@@ -206,30 +412,29 @@ int X509CertStore::validate(int ok, X509_STORE_CTX *ctx, const set<string> &type
     {
         X509 *x509 = X509_STORE_CTX_get0_cert(ctx);
         SCOPE(AUTHORITY_KEYID, akid, X509_get_ext_d2i(x509, NID_authority_key_identifier, nullptr, nullptr));
-        for(const TSL::Service &s: *instance()->d)
+        // Snapshot owned by verify(), other users do not read validity pointer after verification
+        Private::Services services;
+        const Index *list = static_cast<const Index*>(X509_STORE_CTX_get_ex_data(ctx, Private::index()));
+        if(!list)
+            list = (services = instance()->d->services()).get();
+        // Services containing certificate itself or its issuer, in service order
+        set<size_t> matches;
+        for(const Index::Entry &e: list->find(x509))
+            matches.insert(e.service);
+        for(const Index::Entry &e: list->issuers(x509, akid.get()))
         {
-            if(type.find(s.type) == type.cend())
+            if(matches.find(e.service) != matches.cend() || type.find(list->services[e.service].type) == type.cend())
                 continue;
-            if(!any_of(s.certs.cbegin(), s.certs.cend(), [&](const X509Cert &issuer){
-                if(issuer == x509)
-                    return true;
-                if(!akid || !akid->keyid)
-                {
-                    if(X509_NAME_cmp(X509_get_subject_name(issuer.handle()), X509_get_issuer_name(x509)) != 0)
-                        return false;
-                }
-                else
-                {
-                    SCOPE(ASN1_OCTET_STRING, skid, X509_get_ext_d2i(issuer.handle(), NID_subject_key_identifier, nullptr, nullptr));
-                    if(!skid || ASN1_OCTET_STRING_cmp(akid->keyid, skid.get()) != 0)
-                        return false;
-                }
-                SCOPE(EVP_PKEY, pub, X509_get_pubkey(issuer.handle()));
-                if(X509_verify(x509, pub.get()) == 1)
-                    return true;
+            SCOPE(EVP_PKEY, pub, X509_get_pubkey(e.cert->handle()));
+            if(X509_verify(x509, pub.get()) == 1)
+                matches.insert(e.service);
+            else
                 OpenSSLException(); //Clear errors
-                return false;
-            }))
+        }
+        for(size_t i: matches)
+        {
+            const TSL::Service &s = list->services[i];
+            if(type.find(s.type) == type.cend())
                 continue;
             X509_STORE_CTX_set_ex_data(ctx, 0, const_cast<TSL::Validity*>(&s.validity[0]));
             X509_VERIFY_PARAM *param = X509_STORE_CTX_get0_param(ctx);
@@ -259,10 +464,13 @@ bool X509CertStore::verify(const X509Cert &cert, bool noqscd) const
     activate(cert.issuerName("C"));
     const ASN1_TIME *asn1time = X509_get0_notBefore(cert.handle());
     time_t time = util::date::ASN1TimeToTime_t(string((const char*)asn1time->data, size_t(asn1time->length)), asn1time->type == V_ASN1_GENERALIZEDTIME);
-    SCOPE(X509_STORE, store, createStore(X509CertStore::CA, &time));
     SCOPE(X509_STORE_CTX, csc, X509_STORE_CTX_new());
-    if(!X509_STORE_CTX_init(csc.get(), store.get(), cert.handle(), nullptr))
+    if(!X509_STORE_CTX_init(csc.get(), d->caStore.get(), cert.handle(), nullptr))
         THROW_OPENSSLEXCEPTION("Failed to init X509_STORE_CTX");
+    X509_STORE_CTX_set_time(csc.get(), 0, time);
+    // Keep services alive while validity pointer is used
+    Private::Services services = d->services();
+    X509_STORE_CTX_set_ex_data(csc.get(), Private::index(), const_cast<Index*>(services.get()));
     if(X509_verify_cert(csc.get()) > 0)
     {
         if(noqscd)
@@ -21,10 +21,12 @@
 
 #include "X509Cert.h"
 
+#include <memory>
 #include <set>
 
 using X509_STORE = struct x509_store_st;
 using X509_STORE_CTX = struct x509_store_ctx_st;
+struct stack_st_X509;
 
 namespace digidoc
 {
@@ -40,8 +42,11 @@ namespace digidoc
 
           void activate(const std::string &territory) const;
           std::vector<X509Cert> certs(const std::set<std::string> &type) const;
+          std::shared_ptr<stack_st_X509> certStack(const std::set<std::string> &type) const;
           X509Cert findIssuer(const X509Cert &cert, const std::set<std::string> &type) const;
           static X509_STORE* createStore(const std::set<std::string> &type, const time_t *t = nullptr);
+          static void startRefresh();
+          static void stopRefresh();
           bool verify(const X509Cert &cert, bool qscd) const;
 
       private:
@@ -50,6 +55,7 @@ namespace digidoc
           DISABLE_COPY(X509CertStore);
 
           static int validate(int ok, X509_STORE_CTX *ctx, const std::set<std::string> &type);
+          class Index;
           class Private;
           Private *d;
     };
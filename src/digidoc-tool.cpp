@@ -32,13 +32,19 @@
 #include "util/File.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <set>
 #include <sstream>
+#include <thread>
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -273,10 +279,11 @@ public:
     string _logFile, tsurl, tslurl, uri, siguri;
 
     // Params
-    string path, profile, pkcs11, pkcs12, pin, city, street, state, postalCode, country, cert;
+    string path, profile, pkcs11, pkcs12, pin, city, street, state, postalCode, country, cert, journal;
     vector<unsigned char> thumbprint;
     vector<pair<string,string> > files;
     vector<string> roles;
+    int threads = 1;
     bool cng = true, selectFirst = false, doSign = true, dontValidate = false, XAdESEN = false;
     static const map<string,string> profiles;
     static string RED, GREEN, YELLOW, RESET;
@@ -301,6 +308,9 @@ static void printUsage(const char *executable)
     << "  Command createBatch:" << endl
     << "    Example: " << executable << " createBatch folder/content/to/sign" << endl
     << "    Available options:" << endl
+    << "      --threads=     - number of files signed in parallel, 0 uses number of CPU cores (default 1)" << endl
+    << "      --journal=     - file to record signed files, files listed in it are skipped on next run" << endl
+    << "      files with existing .asice container are skipped" << endl
     << "      for additional options look sign command" << endl << endl
     << "  Command open:" << endl
     << "    Example: " << executable << " open container-file.asice" << endl
@@ -439,6 +449,15 @@ ToolConfig::ToolConfig(int argc, char *argv[])
         else if(arg.find("--tslcert=") == 0) tslcerts = { X509Cert(arg.substr(10)) };
         else if(arg == "--TSLAllowExpired") expired = true;
         else if(arg == "--dontsign") doSign = false;
+        else if(arg.find("--threads=") == 0)
+        {
+            // Invalid value is reported by command with usage
+            string value = arg.substr(10);
+            char *end = nullptr;
+            long count = strtol(value.c_str(), &end, 10);
+            threads = !value.empty() && *end == 0 && count >= 0 && count <= 1024 ? int(count) : -1;
+        }
+        else if(arg.find("--journal=") == 0) journal = arg.substr(10);
         else if(arg == "--nocolor") RED = GREEN = YELLOW = RESET = string();
         else if(arg.find("--loglevel=") == 0) _logLevel = stoi(arg.substr(11));
         else if(arg.find("--logfile=") == 0) _logFile = arg.substr(10);
@@ -490,10 +509,9 @@ unique_ptr<Signer> ToolConfig::getSigner(bool getwebsigner) const
     return signer;
 }
 
-static int validateSignature(const Signature *s, ToolConfig::Warning warning = ToolConfig::WWarning)
+static int validateSignature(const Signature::Validator &v, ToolConfig::Warning warning = ToolConfig::WWarning)
 {
     int returnCode = EXIT_SUCCESS;
-    Signature::Validator v(s);
     cout << "    Validation: ";
     switch (v.status()) {
     case Signature::Validator::Valid:
@@ -540,6 +558,11 @@ static int validateSignature(const Signature *s, ToolConfig::Warning warning = T
     return returnCode;
 }
 
+static int validateSignature(const Signature *s, ToolConfig::Warning warning = ToolConfig::WWarning)
+{
+    return validateSignature(Signature::Validator(s), warning);
+}
+
 /**
  * Open container
  *
@@ -624,13 +647,14 @@ static int open(int argc, char* argv[])
 
         // Print container signatures list.
         cout << endl << "Signatures (" << doc->signatures().size() << "):" << endl;
+        // Validate signatures concurrently. Checks, whether signature format is correct
+        // and signed documents checksums are correct.
+        vector<unique_ptr<Signature::Validator>> validators = Signature::Validator::validateAll(doc->signatures());
         unsigned int pos = 0;
         for(const Signature *s: doc->signatures())
         {
-            cout << "  Signature " << pos++ << " (" << s->profile().c_str() << "):" << endl;
-            // Validate signature. Checks, whether signature format is correct
-            // and signed documents checksums are correct.
-            if(validateSignature(s, reportwarnings) == EXIT_FAILURE)
+            cout << "  Signature " << pos << " (" << s->profile().c_str() << "):" << endl;
+            if(validateSignature(*validators[pos++], reportwarnings) == EXIT_FAILURE)
                 returnCode = EXIT_FAILURE;
 
             // Get signature production place info.
@@ -787,7 +811,7 @@ static int add(const ToolConfig &p, char *program)
  * @param dontValidate Do not validate result
  * @return EXIT_FAILURE (1) - failure, EXIT_SUCCESS (0) - success
  */
-static int signContainer(Container *doc, const unique_ptr<Signer> &signer, bool dontValidate = false)
+static int signContainer(Container *doc, const unique_ptr<Signer> &signer, bool dontValidate = false, ostream &out = cout)
 {
     if(Signature *signature = doc->sign(signer.get()))
     {
@@ -795,10 +819,10 @@ static int signContainer(Container *doc, const unique_ptr<Signer> &signer, bool
             return EXIT_SUCCESS;
         try {
             signature->validate();
-            cout << "    Validation: " << ToolConfig::GREEN << "OK" << ToolConfig::RESET << endl;
+            out << "    Validation: " << ToolConfig::GREEN << "OK" << ToolConfig::RESET << endl;
         } catch(const Exception &e) {
-            cout << "    Validation: " << ToolConfig::RED << "FAILED" << ToolConfig::RESET << endl;
-            cout << "     Exception:" << endl << e;
+            out << "    Validation: " << ToolConfig::RED << "FAILED" << ToolConfig::RESET << endl;
+            out << "     Exception:" << endl << e;
             return EXIT_FAILURE;
         }
         return EXIT_SUCCESS;
@@ -846,7 +870,11 @@ static int create(const ToolConfig &p, char *program)
 }
 
 /**
- * Create new container.
+ * Create and sign container for each file in folder.
+ *
+ * Files are signed by <code>threads</code> workers sharing one signer. Successfully signed
+ * files are appended to journal by name relative to folder and skipped when batch is restarted
+ * with same journal. Files with existing container are reported and skipped.
  *
  * @param p ToolConfig object
  * @param program command line argument.
@@ -854,37 +882,103 @@ static int create(const ToolConfig &p, char *program)
  */
 static int createBatch(const ToolConfig &p, char *program)
 {
-    if(p.path.empty())
+    if(p.path.empty() || p.threads < 0)
     {
         printUsage(program);
         return EXIT_FAILURE;
     }
 
     unique_ptr<Signer> signer;
+    unsigned int threads = p.threads == 0 ? max(thread::hardware_concurrency(), 1U) : unsigned(p.threads);
     try {
         signer = p.getSigner();
+        if(PKCS11Signer *pkcs11 = dynamic_cast<PKCS11Signer*>(signer.get()))
+            pkcs11->setMaxSessions(threads);
+        // Select certificate before workers are started
+        signer->cert();
     } catch(const Exception &e) {
         cout << "Caught Exception:" << endl << e;
         return EXIT_FAILURE;
     }
 
-    int returnCode = EXIT_SUCCESS;
+    set<string> done;
+    ofstream journal;
+    if(!p.journal.empty())
+    {
+        // Last line without newline was cut by interrupted run and does not match any file
+        bool truncated = false;
+        ifstream in(File::encodeName(p.journal).c_str(), ifstream::binary);
+        for(string line; getline(in, line);)
+        {
+            if(in.eof())
+            {
+                truncated = true;
+                break;
+            }
+            done.insert(line);
+        }
+        in.close();
+        journal.open(File::encodeName(p.journal).c_str(), ofstream::app|ofstream::binary);
+        if(!journal)
+        {
+            cout << "Failed to open journal: " << p.journal << endl;
+            return EXIT_FAILURE;
+        }
+        if(truncated)
+            journal << '\n';
+    }
+
+    vector<string> files;
+    size_t skipped = 0;
     for(const string &file: File::listFiles(p.path))
     {
-        if(file.compare(file.size() - 6, 6, ".asice") == 0)
+        if(file.size() >= 6 && file.compare(file.size() - 6, 6, ".asice") == 0)
             continue;
-        cout << "Signing file: " << file << endl;
-        try {
-            unique_ptr<Container> doc = Container::createPtr(file + ".asice");
-            doc->addDataFile(file, "application/octet-stream");
-            if(signContainer(doc.get(), signer, p.dontValidate) == EXIT_FAILURE)
+        if(done.find(File::fileName(file)) != done.cend())
+            ++skipped;
+        else if(File::fileExists(file + ".asice"))
+            cout << "Skipping file: " << file << ", container " << file << ".asice already exists" << endl;
+        else
+            files.push_back(file);
+    }
+    if(skipped > 0)
+        cout << "Skipping " << skipped << " files listed in journal" << endl;
+    threads = min<unsigned int>(threads, unsigned(files.size()));
+
+    mutex lock;
+    atomic<size_t> next(0);
+    size_t finished = 0;
+    int returnCode = EXIT_SUCCESS;
+    auto worker = [&] {
+        for(size_t i = next++; i < files.size(); i = next++)
+        {
+            const string &file = files[i];
+            stringstream out;
+            bool success = true;
+            try {
+                unique_ptr<Container> doc = Container::createPtr(file + ".asice");
+                doc->addDataFile(file, "application/octet-stream");
+                success = signContainer(doc.get(), signer, p.dontValidate, out) == EXIT_SUCCESS;
+                doc->save();
+            } catch(const Exception &e) {
+                out << "  Exception:" << endl << e;
+                success = false;
+            }
+
+            lock_guard<mutex> guard(lock);
+            cout << "[" << ++finished << "/" << files.size() << "] Signing file: " << file << endl << out.str();
+            if(!success)
                 returnCode = EXIT_FAILURE;
-            doc->save();
-        } catch(const Exception &e) {
-            cout << "  Exception:" << endl << e;
-            returnCode = EXIT_FAILURE;
+            else if(journal.is_open())
+                journal << File::fileName(file) << endl;
         }
-    }
+    };
+    vector<future<void>> workers;
+    for(unsigned int i = 1; i < threads; ++i)
+        workers.push_back(async(launch::async, worker));
+    worker();
+    for(future<void> &f: workers)
+        f.get();
 
     return returnCode;
 }
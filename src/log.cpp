@@ -26,11 +26,15 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 
 using namespace digidoc;
 using namespace digidoc::util;
 using namespace std;
 
+static mutex logMutex;
+
 /**
  * Formats string, use same syntax as <code>printf()</code> function.
  * Example implementation from:
@@ -69,33 +73,45 @@ string Log::formatArgList(const char* fmt, va_list args)
     return result;
 }
 
+/**
+ * Writes a log line. Line is formatted before taking the lock, so that
+ * messages from concurrent threads are not interleaved.
+ */
 void Log::out(LogType type, const char *file, unsigned int line, const char *format, ...)
 {
     Conf *conf = Conf::instance();
     if(!conf || conf->logLevel() < type)
         return;
 
-    ostream *o = &cout;
-    fstream f;
-    if(!conf->logFile().empty())
-    {
-        f.open(File::encodeName(conf->logFile()).c_str(), fstream::out|fstream::app);
-        o = &f;
-    }
-    *o << date::xsd2string(date::makeDateTime(date::gmtime(time(nullptr)))) << " ";
+    stringstream o;
+    o << date::xsd2string(date::makeDateTime(date::gmtime(time(nullptr)))) << " ";
     switch(type)
     {
-    case ErrorType: *o << "E"; break;
-    case WarnType: *o << "W"; break;
-    case InfoType: *o << "I"; break;
-    case DebugType: *o << "D"; break;
+    case ErrorType: o << "E"; break;
+    case WarnType: o << "W"; break;
+    case InfoType: o << "I"; break;
+    case DebugType: o << "D"; break;
     }
-    *o << " [" << File::fileName(file) << ":" << line << "] - ";
+    o << " [" << File::fileName(file) << ":" << line << "] - ";
 
     va_list args;
     va_start(args, format);
-    *o << formatArgList(format, args).c_str() << "\n";
+    o << formatArgList(format, args).c_str() << "\n";
     va_end(args);
+    write(o.str());
+}
+
+void Log::write(const string &msg)
+{
+    Conf *conf = Conf::instance();
+    lock_guard<mutex> lock(logMutex);
+    if(!conf || conf->logFile().empty())
+    {
+        cout << msg;
+        return;
+    }
+    fstream f(File::encodeName(conf->logFile()).c_str(), fstream::out|fstream::app);
+    f << msg;
 }
 
 void Log::dbgPrintfMemImpl(const char *msg, const void *ptr, size_t size, const char *file, int line)
@@ -104,18 +120,12 @@ void Log::dbgPrintfMemImpl(const char *msg, const void *ptr, size_t size, const
     if(!conf || conf->logLevel() < DebugType)
         return;
 
-    ostream *o = &cout;
-    fstream f;
-    if(!conf->logFile().empty())
-    {
-        f.open(File::encodeName(conf->logFile()).c_str(), fstream::out|fstream::app);
-        o = &f;
-    }
-
+    stringstream o;
     const unsigned char *data = (const unsigned char*)ptr;
-    *o << "DEBUG [" << File::fileName(file) << ":" << line << "] - " << msg << " { ";
-    *o << hex << uppercase << setfill('0');
+    o << "DEBUG [" << File::fileName(file) << ":" << line << "] - " << msg << " { ";
+    o << hex << uppercase << setfill('0');
     for(size_t i = 0; i < size; ++i)
-        *o << setw(2) << static_cast<int>(data[i]) << ' ';
-    *o << dec << nouppercase << setfill(' ') <<"}:" << size << "\n";
+        o << setw(2) << static_cast<int>(data[i]) << ' ';
+    o << dec << nouppercase << setfill(' ') <<"}:" << size << "\n";
+    write(o.str());
 }
@@ -42,6 +42,7 @@ namespace digidoc
 
     private:
         static std::string formatArgList(const char *fmt, va_list args);
+        static void write(const std::string &msg);
     };
 }
 
@@ -36,6 +36,9 @@
 #ifdef _WIN32
     #include <Windows.h>
     #include <direct.h>
+    #include <fcntl.h>
+    #include <io.h>
+    #include <share.h>
 #else
     #include <dirent.h>
     #include <sys/param.h>
@@ -549,6 +552,35 @@ bool File::removeFile(const string &path)
 #endif
 }
 
+/**
+ * Moves file to new location, existing destination file is replaced.
+ */
+bool File::moveFile(const string &from, const string &to)
+{
+#ifdef _WIN32
+    return MoveFileExW(encodeName(from).c_str(), encodeName(to).c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(encodeName(from).c_str(), encodeName(to).c_str()) == 0;
+#endif
+}
+
+/**
+ * Cuts file to <code>size</code> bytes, data after <code>size</code> is discarded.
+ */
+bool File::truncateFile(const string &path, unsigned long long size)
+{
+#ifdef _WIN32
+    int fd = -1;
+    if(_wsopen_s(&fd, encodeName(path).c_str(), _O_WRONLY|_O_BINARY, _SH_DENYNO, _S_IREAD|_S_IWRITE) != 0)
+        return false;
+    bool result = _chsize_s(fd, __int64(size)) == 0;
+    _close(fd);
+    return result;
+#else
+    return truncate(encodeName(path).c_str(), off_t(size)) == 0;
+#endif
+}
+
 /**
  * Helper method for converting strings with non-ascii characters to the URI format (%HH for each non-ascii character).
  *
@@ -57,6 +57,8 @@ namespace digidoc
               static std::vector<std::string> listFiles(const std::string& directory);
               static void deleteTempFiles();
               static bool removeFile(const std::string &path);
+              static bool moveFile(const std::string &from, const std::string &to);
+              static bool truncateFile(const std::string &path, unsigned long long size);
               static std::string toUri(const std::string &path);
               static std::string toUriPath(const std::string &path);
               static std::string fromUriPath(const std::string &path);
@@ -0,0 +1,144 @@
+/*
+ * libdigidocpp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "ThreadPool.h"
+
+#include "../log.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace digidoc;
+using namespace digidoc::util;
+using namespace std;
+
+namespace {
+/**
+ * Process wide pool, destroyed with other function-local statics on exit after joining its threads
+ */
+class Pool
+{
+public:
+    ~Pool()
+    {
+        stop(false);
+    }
+
+    static Pool& instance()
+    {
+        static Pool pool;
+        return pool;
+    }
+
+    void enqueue(packaged_task<void()> &&task)
+    {
+        lock_guard<mutex> lock(m);
+        tasks.push_back(move(task));
+        // Workers are draining queue, task is picked up by them or by thread started after stop
+        if(stopping)
+            return;
+        size_t limit = max(thread::hardware_concurrency(), 1U) * 4;
+        if(tasks.size() > idle && threads.size() < limit)
+        {
+            DEBUG("ThreadPool::enqueue starting thread %lu", (unsigned long)threads.size() + 1);
+            threads.push_back(thread(&Pool::worker, this));
+        }
+        wakeup.notify_one();
+    }
+
+    void stop(bool restart)
+    {
+        vector<thread> list;
+        {
+            lock_guard<mutex> lock(m);
+            // Thread can not join itself, pool keeps running when stop is called from task
+            for(const thread &t: threads)
+            {
+                if(t.get_id() == this_thread::get_id())
+                {
+                    WARN("ThreadPool::stop called from pool thread, threads are not stopped");
+                    return;
+                }
+            }
+            stopping = true;
+            list.swap(threads);
+        }
+        wakeup.notify_all();
+        for(thread &t: list)
+            t.join();
+        lock_guard<mutex> lock(m);
+        stopping = false;
+        if(restart && !tasks.empty() && threads.empty())
+            threads.push_back(thread(&Pool::worker, this));
+    }
+
+private:
+    void worker()
+    {
+        unique_lock<mutex> lock(m);
+        while(true)
+        {
+            ++idle;
+            wakeup.wait(lock, [this]{ return stopping || !tasks.empty(); });
+            --idle;
+            if(tasks.empty())
+                return;
+            packaged_task<void()> task = move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    mutex m;
+    condition_variable wakeup;
+    deque<packaged_task<void()>> tasks;
+    vector<thread> threads;
+    size_t idle = 0;
+    bool stopping = false;
+};
+}
+
+/**
+ * @class digidoc::util::ThreadPool
+ * @brief Shared executor for asynchronous library operations.
+ *
+ * Threads are started on demand when no idle thread is waiting for the queued tasks.
+ * Tasks mostly wait on network (OCSP, TSA), so concurrency is bounded at 4 threads per CPU core
+ * (<code>std::thread::hardware_concurrency</code>, at least 4 threads). Tasks exceeding the limit
+ * are queued until a thread is free.
+ */
+
+void ThreadPool::enqueue(packaged_task<void()> &&task)
+{
+    Pool::instance().enqueue(move(task));
+}
+
+/**
+ * Finishes queued tasks and stops all threads. Pool is started again on next task.
+ * Call from a pool task is ignored, as the calling thread can not be joined.
+ */
+void ThreadPool::stop()
+{
+    Pool::instance().stop(true);
+}
@@ -0,0 +1,47 @@
+/*
+ * libdigidocpp
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#pragma once
+
+#include <future>
+#include <memory>
+
+namespace digidoc
+{
+    namespace util
+    {
+        class ThreadPool
+        {
+        public:
+            template<class F>
+            static auto run(F f) -> std::future<decltype(f())>
+            {
+                typedef decltype(f()) R;
+                std::shared_ptr<std::packaged_task<R()>> task(new std::packaged_task<R()>(std::move(f)));
+                std::future<R> result = task->get_future();
+                enqueue(std::packaged_task<void()>([task]{ (*task)(); }));
+                return result;
+            }
+            static void stop();
+
+        private:
+            static void enqueue(std::packaged_task<void()> &&task);
+        };
+    }
+}
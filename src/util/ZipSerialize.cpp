@@ -19,6 +19,7 @@
 
 #include "ZipSerialize.h"
 
+#include "../Conf.h"
 #include "../log.h"
 #include "../util/File.h"
 
@@ -28,7 +29,16 @@
 #include <minizip/iowin32.h>
 #endif
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 using namespace digidoc;
 using namespace std;
@@ -36,53 +46,666 @@ using namespace std;
 class ZipSerialize::Private: public zlib_filefunc_def
 {
 public:
+    struct Entry
+    {
+        unz64_file_pos pos;
+        ZPOS64_T compressedSize, size;
+        uLong crc, method;
+        tm_unz time;
+        string comment;
+    };
+
+    struct Reader
+    {
+        ~Reader() { close(); }
+        void close();
+
+        mutex lock;
+        unzFile handle = nullptr;
+        ZPOS64_T offset = 0;
+    };
+
+    class EntryBuf;
+    class EntryStream;
+
+    ~Private();
+    void openReader();
+    void closeReader();
+    void backupDirectory();
+    void restoreDirectory();
+    void buildIndex();
+    const Entry &entry(const string &file) const;
+    void openEntry(const string &file);
+    size_t read(Reader &r, const string &file, ZPOS64_T offset, char *data, size_t size);
+    bool copyRaw(const string &file, zipFile dest, const string &containerPath,
+        const zip_fileinfo &info, const string &comment, uLong flags, bool store);
+    void deflateParallel(istream &is, int level, unsigned int threads, uLong &crc, ZPOS64_T &size);
+
+    static const size_t DEFLATE_BLOCK = 128 * 1024;
+    static const size_t DEFLATE_DICT = 32 * 1024;
+
     string path;
     zipFile create = nullptr;
     unzFile open = nullptr;
+    vector<string> list;
+    unordered_map<string,Entry> index;
+    vector<weak_ptr<Reader>> readers;
+    ZPOS64_T directoryOffset = 0;
+    vector<char> directory;
+    string current;
+    mutex lock;
 };
 
+const size_t ZipSerialize::Private::DEFLATE_BLOCK;
+const size_t ZipSerialize::Private::DEFLATE_DICT;
+
+/**
+ * Reads single ZIP entry on demand without extracting it to memory or to a temporary file.
+ * Stored entries are copied straight from the archive, deflated entries are inflated
+ * while reading. Each stream has its own archive handle and inflate state, so reading
+ * several entries in turn does not restart them. Seeking backwards restarts the entry.
+ */
+class ZipSerialize::Private::EntryBuf: public streambuf
+{
+public:
+    EntryBuf(shared_ptr<Private> zip, shared_ptr<Reader> reader, string file, ZPOS64_T size)
+        : zip_(move(zip)), reader_(move(reader)), file_(move(file)), size_(size), buf_(10240)
+    {
+        setg(buf_.data(), buf_.data(), buf_.data());
+    }
+
+    const shared_ptr<Private> &zip() const { return zip_; }
+    const string &file() const { return file_; }
+
+protected:
+    int_type underflow() override
+    {
+        if(gptr() < egptr())
+            return traits_type::to_int_type(*gptr());
+        // Read errors are propagated, so that damaged entry is not mistaken for end of data
+        size_t size = zip_->read(*reader_, file_, pos_, buf_.data(), buf_.size());
+        if(size == 0)
+            return traits_type::eof();
+        pos_ += size;
+        setg(buf_.data(), buf_.data(), buf_.data() + size);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) override
+    {
+        switch(dir)
+        {
+        case ios_base::beg: return seekpos(pos_type(off), which);
+        case ios_base::cur: return seekpos(pos_type(off_type(pos_ - ZPOS64_T(egptr() - gptr())) + off), which);
+        case ios_base::end: return seekpos(pos_type(off_type(size_) + off), which);
+        default: return pos_type(off_type(-1));
+        }
+    }
+
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override
+    {
+        if(!(which & ios_base::in) || off_type(pos) < 0 || ZPOS64_T(off_type(pos)) > size_)
+            return pos_type(off_type(-1));
+        pos_ = ZPOS64_T(off_type(pos));
+        setg(buf_.data(), buf_.data(), buf_.data());
+        return pos;
+    }
+
+private:
+    shared_ptr<Private> zip_;
+    shared_ptr<Reader> reader_;
+    string file_;
+    ZPOS64_T size_, pos_ = 0;
+    vector<char> buf_;
+};
+
+class ZipSerialize::Private::EntryStream: public istream
+{
+public:
+    EntryStream(shared_ptr<Private> zip, shared_ptr<Reader> reader, string file, ZPOS64_T size)
+        : istream(nullptr), buf_(std::move(zip), std::move(reader), std::move(file), size)
+    {
+        rdbuf(&buf_);
+        // Rethrow read, inflate and CRC errors from EntryBuf
+        exceptions(badbit);
+    }
+
+    const EntryBuf &entry() const { return buf_; }
+
+private:
+    EntryBuf buf_;
+};
+
+void ZipSerialize::Private::Reader::close()
+{
+    if(handle)
+    {
+        unzCloseCurrentFile(handle);
+        unzClose(handle);
+    }
+    handle = nullptr;
+    offset = 0;
+}
+
+ZipSerialize::Private::~Private()
+{
+    if(create) zipClose(create, nullptr);
+    if(!directory.empty())
+        restoreDirectory();
+    closeReader();
+}
+
+void ZipSerialize::Private::openReader()
+{
+    if(open)
+        return;
+    DEBUG("ZipSerialize::open(%s)", path.c_str());
+    open = unzOpen2((const char*)util::File::encodeName(path).c_str(), this);
+    if(!open)
+        THROW("Failed to open ZIP file '%s'.", path.c_str());
+    try
+    {
+        buildIndex();
+    }
+    catch(const Exception &)
+    {
+        closeReader();
+        throw;
+    }
+}
+
+void ZipSerialize::Private::closeReader()
+{
+    if(open)
+    {
+        if(!current.empty())
+            unzCloseCurrentFile(open);
+        unzClose(open);
+    }
+    open = nullptr;
+    list.clear();
+    index.clear();
+    current.clear();
+}
+
+/**
+ * Saves central directory and end of central directory records, before new entries are
+ * written over them in append mode.
+ */
+void ZipSerialize::Private::backupDirectory()
+{
+    static const size_t EOCD_SIZE = 22, EOCD64_LOCATOR_SIZE = 20, EOCD64_SIZE = 56;
+    auto le = [](const char *p, size_t size) {
+        ZPOS64_T value = 0;
+        for(size_t i = size; i > 0; --i)
+            value = value << 8 | ZPOS64_T((unsigned char)p[i - 1]);
+        return value;
+    };
+
+    ifstream f(util::File::encodeName(path).c_str(), ifstream::binary);
+    f.seekg(0, ifstream::end);
+    ZPOS64_T fileSize = ZPOS64_T(max<streamoff>(f.tellg(), 0));
+    // End of central directory record is followed only by archive comment
+    vector<char> tail(size_t(min<ZPOS64_T>(fileSize, EOCD_SIZE + 0xFFFF)));
+    f.seekg(streamoff(fileSize - tail.size()));
+    if(!f || tail.size() < EOCD_SIZE || !f.read(tail.data(), streamsize(tail.size())))
+        THROW("Failed to read ZIP file '%s'.", path.c_str());
+    size_t eocd = tail.size() - EOCD_SIZE;
+    while(memcmp(&tail[eocd], "PK\5\6", 4) != 0)
+    {
+        if(eocd-- == 0)
+            THROW("Failed to find central directory of ZIP file '%s'.", path.c_str());
+    }
+
+    ZPOS64_T offset = le(&tail[eocd + 16], 4);
+    if(offset == 0xFFFFFFFF)
+    {
+        size_t locator = eocd - EOCD64_LOCATOR_SIZE;
+        if(eocd < EOCD64_LOCATOR_SIZE || memcmp(&tail[locator], "PK\6\7", 4) != 0)
+            THROW("Failed to find ZIP64 central directory of ZIP file '%s'.", path.c_str());
+        char eocd64[EOCD64_SIZE];
+        f.seekg(streamoff(le(&tail[locator + 8], 8)));
+        if(!f.read(eocd64, sizeof(eocd64)) || memcmp(eocd64, "PK\6\6", 4) != 0)
+            THROW("Failed to find ZIP64 central directory of ZIP file '%s'.", path.c_str());
+        offset = le(&eocd64[48], 8);
+    }
+    if(offset > fileSize)
+        THROW("Invalid central directory offset in ZIP file '%s'.", path.c_str());
+
+    directory.resize(size_t(fileSize - offset));
+    f.seekg(streamoff(offset));
+    if(!f.read(directory.data(), streamsize(directory.size())))
+        THROW("Failed to read central directory of ZIP file '%s'.", path.c_str());
+    directoryOffset = offset;
+}
+
+/**
+ * Rolls back unsaved append, cuts new entries off and puts saved central directory back.
+ */
+void ZipSerialize::Private::restoreDirectory()
+{
+    WARN("Restoring central directory of ZIP file '%s'.", path.c_str());
+    if(!util::File::truncateFile(path, directoryOffset))
+    {
+        ERR("Failed to restore ZIP file '%s'.", path.c_str());
+        return;
+    }
+    ofstream f(util::File::encodeName(path).c_str(), ofstream::binary|ofstream::app);
+    if(!f.write(directory.data(), streamsize(directory.size())) || !f.flush())
+        ERR("Failed to restore ZIP file '%s'.", path.c_str());
+    directory.clear();
+}
+
+/**
+ * Reads central directory once and indexes entries by file name.
+ * When an archive contains duplicate names the first entry wins, same as unzLocateFile.
+ */
+void ZipSerialize::Private::buildIndex()
+{
+    for(int unzResult = unzGoToFirstFile(open); unzResult != UNZ_END_OF_LIST_OF_FILE; unzResult = unzGoToNextFile(open))
+    {
+        if(unzResult != UNZ_OK)
+            THROW("Failed to go to the next file inside ZIP container. ZLib error: %d", unzResult);
+
+        unz_file_info64 fileInfo;
+        unzResult = unzGetCurrentFileInfo64(open, &fileInfo, nullptr, 0, nullptr, 0, nullptr, 0);
+        if(unzResult != UNZ_OK)
+            THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
+
+        string fileName(fileInfo.size_filename, 0);
+        Entry e;
+        e.comment.resize(fileInfo.size_file_comment);
+        unzResult = unzGetCurrentFileInfo64(open, &fileInfo, &fileName[0], uLong(fileName.size()),
+            nullptr, 0, e.comment.empty() ? nullptr : &e.comment[0], uLong(e.comment.size()));
+        if(unzResult != UNZ_OK)
+            THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
+
+        unzResult = unzGetFilePos64(open, &e.pos);
+        if(unzResult != UNZ_OK)
+            THROW("Failed to get position of the current file inside ZIP container. ZLib error: %d", unzResult);
+
+        e.compressedSize = fileInfo.compressed_size;
+        e.size = fileInfo.uncompressed_size;
+        e.crc = fileInfo.crc;
+        e.method = fileInfo.compression_method;
+        e.time = fileInfo.tmu_date;
+        index.emplace(fileName, move(e));
+        list.push_back(move(fileName));
+    }
+}
+
+const ZipSerialize::Private::Entry &ZipSerialize::Private::entry(const string &file) const
+{
+    unordered_map<string,Entry>::const_iterator i = index.find(file);
+    if(i == index.cend())
+        THROW("Failed to locate file '%s' inside ZIP container.", file.c_str());
+    return i->second;
+}
+
+/**
+ * Positions reader to the start of <code>file</code> data. Caller must hold the lock.
+ */
+void ZipSerialize::Private::openEntry(const string &file)
+{
+    openReader();
+    if(!current.empty())
+        unzCloseCurrentFile(open);
+    current.clear();
 
+    int unzResult = unzGoToFilePos64(open, &entry(file).pos);
+    if(unzResult != UNZ_OK)
+        THROW("Failed to locate file inside ZIP container. ZLib error: %d", unzResult);
+
+    unzResult = unzOpenCurrentFile(open);
+    if(unzResult != UNZ_OK)
+        THROW("Failed to open file inside ZIP container. ZLib error: %d", unzResult);
+    current = file;
+}
+
+/**
+ * Reads up to <code>size</code> bytes of <code>file</code> starting from uncompressed <code>offset</code>
+ * with reader <code>r</code> own archive handle. Sequential reads continue from the current inflate
+ * state, reading backwards reopens the entry. Handle is released at the end of data and CRC is verified.
+ */
+size_t ZipSerialize::Private::read(Reader &r, const string &file, ZPOS64_T offset, char *data, size_t size)
+{
+    lock_guard<mutex> guard(r.lock);
+    if(!r.handle || r.offset > offset)
+    {
+        unz64_file_pos pos;
+        {
+            lock_guard<mutex> zipGuard(lock);
+            openReader();
+            const Entry &e = entry(file);
+            if(offset >= e.size)
+                return 0;
+            pos = e.pos;
+        }
+        r.close();
+        r.handle = unzOpen2((const char*)util::File::encodeName(path).c_str(), this);
+        if(!r.handle)
+            THROW("Failed to open ZIP file '%s'.", path.c_str());
+        int unzResult = unzGoToFilePos64(r.handle, &pos);
+        if(unzResult != UNZ_OK)
+        {
+            r.close();
+            THROW("Failed to locate file inside ZIP container. ZLib error: %d", unzResult);
+        }
+        unzResult = unzOpenCurrentFile(r.handle);
+        if(unzResult != UNZ_OK)
+        {
+            r.close();
+            THROW("Failed to open file inside ZIP container. ZLib error: %d", unzResult);
+        }
+    }
+
+    char skip[10240];
+    while(r.offset < offset)
+    {
+        int unzResult = unzReadCurrentFile(r.handle, skip, unsigned(min<ZPOS64_T>(sizeof(skip), offset - r.offset)));
+        if(unzResult <= UNZ_EOF)
+        {
+            r.close();
+            THROW("Failed to read bytes from current file inside ZIP container. ZLib error: %d", unzResult);
+        }
+        r.offset += ZPOS64_T(unzResult);
+    }
+
+    int unzResult = unzReadCurrentFile(r.handle, data, unsigned(size));
+    if(unzResult < UNZ_EOF)
+    {
+        r.close();
+        THROW("Failed to read bytes from current file inside ZIP container. ZLib error: %d", unzResult);
+    }
+    if(unzResult == UNZ_EOF)
+    {
+        unzResult = unzCloseCurrentFile(r.handle);
+        unzClose(r.handle);
+        r.handle = nullptr;
+        r.offset = 0;
+        if(unzResult != UNZ_OK)
+            THROW("Failed to close current file inside ZIP container. ZLib error: %d", unzResult);
+        return 0;
+    }
+    r.offset += ZPOS64_T(unzResult);
+    return size_t(unzResult);
+}
+
+/**
+ * Copies <code>file</code> compressed data, CRC and sizes to <code>dest</code> archive as is,
+ * without inflating and deflating it again.
+ *
+ * @return returns false and copies nothing when <code>store</code> is requested and
+ *         the entry is compressed, such entry has to be inflated and stored.
+ */
+bool ZipSerialize::Private::copyRaw(const string &file, zipFile dest, const string &containerPath,
+    const zip_fileinfo &info, const string &comment, uLong flags, bool store)
+{
+    lock_guard<mutex> guard(lock);
+    openReader();
+    const Entry &e = entry(file);
+    if(store && e.method != 0)
+        return false;
+    if(!current.empty())
+        unzCloseCurrentFile(open);
+    current.clear();
+
+    int unzResult = unzGoToFilePos64(open, &e.pos);
+    if(unzResult != UNZ_OK)
+        THROW("Failed to locate file inside ZIP container. ZLib error: %d", unzResult);
+
+    int method = 0, level = 0;
+    unzResult = unzOpenCurrentFile2(open, &method, &level, 1);
+    if(unzResult != UNZ_OK)
+        THROW("Failed to open file inside ZIP container. ZLib error: %d", unzResult);
+
+    int zipResult = zipOpenNewFileInZip4(dest, containerPath.c_str(),
+        &info, nullptr, 0, nullptr, 0, comment.c_str(), method, level, 1,
+        -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, nullptr, 0, 0, flags);
+    if(zipResult != ZIP_OK)
+    {
+        unzCloseCurrentFile(open);
+        THROW("Failed to create new file inside ZIP container. ZLib error: %d", zipResult);
+    }
+
+    char buf[10240];
+    while((unzResult = unzReadCurrentFile(open, buf, sizeof(buf))) > UNZ_EOF)
+    {
+        zipResult = zipWriteInFileInZip(dest, buf, unsigned(unzResult));
+        if(zipResult != ZIP_OK)
+        {
+            unzCloseCurrentFile(open);
+            zipCloseFileInZipRaw64(dest, e.size, e.crc);
+            THROW("Failed to write bytes to current file inside ZIP container. ZLib error: %d", zipResult);
+        }
+    }
+    unzCloseCurrentFile(open);
+    if(unzResult < UNZ_EOF)
+    {
+        zipCloseFileInZipRaw64(dest, e.size, e.crc);
+        THROW("Failed to read bytes from current file inside ZIP container. ZLib error: %d", unzResult);
+    }
+
+    zipResult = zipCloseFileInZipRaw64(dest, e.size, e.crc);
+    if(zipResult != ZIP_OK)
+        THROW("Failed to close current file inside ZIP container. ZLib error: %d", zipResult);
+    return true;
+}
+
+
+
+/**
+ * Compresses input on fixed set of <code>threads</code> workers in 128KiB blocks, similar to pigz.
+ * Each block is primed with last 32KiB of previous block and ends with sync flush, last block
+ * finishes the stream, so concatenated output is single valid raw deflate stream written
+ * to the current entry in input order. CRC of the blocks is combined with <code>crc32_combine</code>.
+ */
+void ZipSerialize::Private::deflateParallel(istream &is, int level, unsigned int threads, uLong &crc, ZPOS64_T &size)
+{
+    struct Block
+    {
+        shared_ptr<vector<unsigned char>> in, dict;
+        vector<unsigned char> out;
+        uLong crc = 0;
+        bool finish = false;
+        promise<void> done;
+    };
+
+    auto compress = [level](Block &b) {
+        z_stream s = {};
+        if(deflateInit2(&s, level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            THROW("Failed to initialize deflate stream.");
+        if(b.dict && !b.dict->empty())
+        {
+            size_t dict = min(b.dict->size(), DEFLATE_DICT);
+            deflateSetDictionary(&s, b.dict->data() + b.dict->size() - dict, uInt(dict));
+        }
+        b.out.resize(deflateBound(&s, uLong(b.in->size())) + 64);
+        s.next_in = b.in->data();
+        s.avail_in = uInt(b.in->size());
+        int result = Z_OK;
+        do
+        {
+            if(s.total_out == b.out.size())
+                b.out.resize(b.out.size() * 2);
+            s.next_out = b.out.data() + s.total_out;
+            s.avail_out = uInt(b.out.size() - s.total_out);
+            result = deflate(&s, b.finish ? Z_FINISH : Z_SYNC_FLUSH);
+        } while(result == Z_OK && (b.finish || s.avail_out == 0));
+        b.out.resize(s.total_out);
+        deflateEnd(&s);
+        if(result != (b.finish ? Z_STREAM_END : Z_OK))
+            THROW("Failed to compress data. ZLib error: %d", result);
+        b.crc = crc32(0, b.in->data(), uInt(b.in->size()));
+    };
+
+    struct Workers
+    {
+        mutex lock;
+        condition_variable wakeup;
+        deque<shared_ptr<Block>> jobs;
+        vector<future<void>> threads;
+        bool stopping = false;
+
+        ~Workers()
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+                jobs.clear();
+            }
+            wakeup.notify_all();
+            for(future<void> &t: threads)
+                t.wait();
+        }
+    } workers;
+
+    for(unsigned int i = 0; i < threads; ++i)
+    {
+        workers.threads.push_back(async(launch::async, [&workers, &compress] {
+            while(true)
+            {
+                shared_ptr<Block> b;
+                {
+                    unique_lock<mutex> guard(workers.lock);
+                    workers.wakeup.wait(guard, [&workers] { return workers.stopping || !workers.jobs.empty(); });
+                    if(workers.jobs.empty())
+                        return;
+                    b = std::move(workers.jobs.front());
+                    workers.jobs.pop_front();
+                }
+                try {
+                    compress(*b);
+                    b->done.set_value();
+                } catch(...) {
+                    b->done.set_exception(current_exception());
+                }
+            }
+        }));
+    }
+
+    crc = crc32(0, nullptr, 0);
+    size = 0;
+    deque<pair<shared_ptr<Block>,future<void>>> pending;
+    auto write = [&] {
+        shared_ptr<Block> b = std::move(pending.front().first);
+        future<void> result = std::move(pending.front().second);
+        pending.pop_front();
+        result.get();
+        int zipResult = zipWriteInFileInZip(create, b->out.data(), unsigned(b->out.size()));
+        if(zipResult != ZIP_OK)
+            THROW("Failed to write bytes to current file inside ZIP container. ZLib error: %d", zipResult);
+        crc = crc32_combine(crc, b->crc, z_off_t(b->in->size()));
+        size += b->in->size();
+    };
+
+    shared_ptr<vector<unsigned char>> dict;
+    for(bool last = false; !last;)
+    {
+        shared_ptr<Block> b = make_shared<Block>();
+        b->in = make_shared<vector<unsigned char>>(DEFLATE_BLOCK);
+        is.read((char*)b->in->data(), streamsize(b->in->size()));
+        b->in->resize(size_t(max<streamsize>(is.gcount(), 0)));
+        last = !is || is.peek() == char_traits<char>::eof();
+        b->dict = std::move(dict);
+        b->finish = last;
+        dict = b->in;
+        pending.emplace_back(b, b->done.get_future());
+        {
+            lock_guard<mutex> guard(workers.lock);
+            workers.jobs.push_back(std::move(b));
+        }
+        workers.wakeup.notify_one();
+        // Limit memory usage, keep at most two blocks per worker in flight
+        if(pending.size() >= threads * 2)
+            write();
+    }
+    while(!pending.empty())
+        write();
+}
 
 /**
  * Initializes ZIP file serializer.
  *
  * @param path
+ * @param create open file for writing.
+ * @param append add files to the end of existing ZIP file. New entries are written over
+ *        the old central directory, existing entries are left untouched and new central
+ *        directory is written by <code>save()</code>. When serializer is destroyed without
+ *        <code>save()</code> new entries are cut off and the old central directory is restored.
  */
-ZipSerialize::ZipSerialize(string path, bool create)
-    : d(new Private)
+ZipSerialize::ZipSerialize(string path, bool create, bool append)
+    : d(make_shared<Private>())
 {
 #ifdef _WIN32
-    fill_win32_filefunc(d);
+    fill_win32_filefunc(d.get());
 #else
-    fill_fopen_filefunc(d);
+    fill_fopen_filefunc(d.get());
 #endif
     d->path = std::move(path);
     if(create)
     {
-        DEBUG("ZipSerialize::create(%s)", d->path.c_str());
-        d->create = zipOpen2((const char*)util::File::encodeName(d->path).c_str(), APPEND_STATUS_CREATE, nullptr, d);
+        DEBUG("ZipSerialize::create(%s, append = %d)", d->path.c_str(), append);
+        if(append)
+            d->backupDirectory();
+        d->create = zipOpen2((const char*)util::File::encodeName(d->path).c_str(),
+            append ? APPEND_STATUS_ADDINZIP : APPEND_STATUS_CREATE, nullptr, d.get());
         if(!d->create)
+        {
+            d->directory.clear();
             THROW("Failed to create ZIP file '%s'.", d->path.c_str());
+        }
     }
     else
+        d->openReader();
+}
+
+/**
+ * Desctructs ZIP file serializer. Streams returned by <code>stream()</code> keep
+ * archive open until they are released.
+ *
+ * @param path
+ */
+ZipSerialize::~ZipSerialize() = default;
+
+/**
+ * Releases archive file handles, so that file can be replaced or modified.
+ * Streams returned by <code>stream()</code> reopen and reindex the archive on next read.
+ */
+void ZipSerialize::close()
+{
+    vector<shared_ptr<Private::Reader>> readers;
+    {
+        lock_guard<mutex> guard(d->lock);
+        d->closeReader();
+        for(const weak_ptr<Private::Reader> &reader: d->readers)
+        {
+            if(shared_ptr<Private::Reader> r = reader.lock())
+                readers.push_back(move(r));
+        }
+    }
+    for(const shared_ptr<Private::Reader> &r: readers)
     {
-        DEBUG("ZipSerialize::open(%s)", d->path.c_str());
-        d->open = unzOpen2((const char*)util::File::encodeName(d->path).c_str(), d);
-        if(!d->open)
-            THROW("Failed to open ZIP file '%s'.", d->path.c_str());
+        lock_guard<mutex> guard(r->lock);
+        r->close();
     }
 }
 
 /**
- * Desctructs ZIP file serializer.
+ * Writes central directory and closes ZIP file opened for writing. Files added
+ * in append mode are kept only when <code>save()</code> succeeds.
  *
- * @param path
+ * @throws Exception throws exception if the central directory could not be written.
  */
-ZipSerialize::~ZipSerialize()
+void ZipSerialize::save()
 {
-    if(d->create) zipClose(d->create, nullptr);
-    if(d->open) unzClose(d->open);
-    delete d;
+    if(!d->create)
+        THROW("Zip file is not open");
+    int zipResult = zipClose(d->create, nullptr);
+    d->create = nullptr;
+    if(zipResult != ZIP_OK)
+        THROW("Failed to save ZIP file '%s'. ZLib error: %d", d->path.c_str(), zipResult);
+    d->directory.clear();
 }
 
 /**
@@ -94,29 +717,11 @@ ZipSerialize::~ZipSerialize()
  */
 vector<string> ZipSerialize::list() const
 {
-    if(!d->open)
+    if(d->create)
         THROW("Zip file is not open");
-
-    vector<string> list;
-    for(int unzResult = unzGoToFirstFile(d->open); unzResult != UNZ_END_OF_LIST_OF_FILE; unzResult = unzGoToNextFile(d->open))
-    {
-        if(unzResult != UNZ_OK)
-            THROW("Failed to go to the next file inside ZIP container. ZLib error: %d", unzResult);
-
-        unz_file_info fileInfo;
-        unzResult = unzGetCurrentFileInfo(d->open, &fileInfo, nullptr, 0, nullptr, 0, nullptr, 0);
-        if(unzResult != UNZ_OK)
-            THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
-
-        string fileName(fileInfo.size_filename, 0);
-        unzResult = unzGetCurrentFileInfo(d->open, &fileInfo, &fileName[0], uLong(fileName.size()), nullptr, 0, nullptr, 0);
-        if(unzResult != UNZ_OK)
-            THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
-
-        list.push_back(std::move(fileName));
-    }
-
-    return list;
+    lock_guard<mutex> guard(d->lock);
+    d->openReader();
+    return d->list;
 }
 
 /**
@@ -133,14 +738,13 @@ void ZipSerialize::extract(const string &file, ostream &os) const
     if(file[file.size()-1] == '/')
         return;
 
-    int unzResult = unzLocateFile(d->open, file.c_str(), 1);
-    if(unzResult != UNZ_OK)
-        THROW("Failed to locate file inside ZIP container. ZLib error: %d", unzResult);
+    if(d->create)
+        THROW("Zip file is not open");
 
-    unzResult = unzOpenCurrentFile(d->open);
-    if(unzResult != UNZ_OK)
-        THROW("Failed to open file inside ZIP container. ZLib error: %d", unzResult);
+    lock_guard<mutex> guard(d->lock);
+    d->openEntry(file);
 
+    int unzResult = 0;
     int currentStreamSize = 0;
     char buf[10240];
     while((unzResult = unzReadCurrentFile(d->open, buf, 10240)) > UNZ_EOF)
@@ -150,9 +754,11 @@ void ZipSerialize::extract(const string &file, ostream &os) const
         if(os.fail())
         {
             unzCloseCurrentFile(d->open);
+            d->current.clear();
             THROW("Failed to write file '%s' data to stream. Stream size: %d", file.c_str(), currentStreamSize);
         }
     }
+    d->current.clear();
     if(unzResult < UNZ_EOF)
     {
         unzCloseCurrentFile(d->open);
@@ -164,10 +770,35 @@ void ZipSerialize::extract(const string &file, ostream &os) const
         THROW("Failed to close current file inside ZIP container. ZLib error: %d", unzResult);
 }
 
+/**
+ * Returns stream reading <code>file</code> directly from ZIP file. Data is inflated
+ * on demand, nothing is extracted before stream is read.
+ *
+ * @param file file path inside ZIP file.
+ * @throws Exception throws exception if file does not exist in ZIP file.
+ */
+unique_ptr<istream> ZipSerialize::stream(const string &file) const
+{
+    if(d->create)
+        THROW("Zip file is not open");
+    lock_guard<mutex> guard(d->lock);
+    d->openReader();
+    ZPOS64_T size = d->entry(file).size;
+    d->readers.erase(remove_if(d->readers.begin(), d->readers.end(),
+        [](const weak_ptr<Private::Reader> &r) { return r.expired(); }), d->readers.end());
+    shared_ptr<Private::Reader> reader = make_shared<Private::Reader>();
+    d->readers.push_back(reader);
+    return unique_ptr<istream>(new Private::EntryStream(d, move(reader), file, size));
+}
+
 /**
  * Add new file to ZIP container. The file is actually archived to ZIP container after <code>save()</code>
  * method is called.
  *
+ * When <code>is</code> is a stream returned by <code>stream()</code> of another archive, entry is
+ * copied in compressed form and compression method is preserved. Only compressed entry
+ * added with <code>DontCompress</code> is inflated and stored.
+ *
  * @param containerPath file path inside ZIP file.
  * @param path full path of the file that should be added to ZIP file.
  * @see create()
@@ -183,19 +814,59 @@ void ZipSerialize::addFile(const string& containerPath, istream &is, const Prope
         { uInt(prop.time.tm_sec), uInt(prop.time.tm_min), uInt(prop.time.tm_hour),
           uInt(prop.time.tm_mday), uInt(prop.time.tm_mon), uInt(prop.time.tm_year) },
         0, 0, 0 };
+    uLong UTF8_encoding = 1 << 11; // general purpose bit 11 for unicode
 
-    // Create new file inside ZIP container.
+    if(Private::EntryStream *source = dynamic_cast<Private::EntryStream*>(&is))
+    {
+        if(source->entry().zip() != d && source->entry().zip()->copyRaw(source->entry().file(),
+                d->create, containerPath, info, prop.comment, UTF8_encoding, flags & DontCompress))
+            return;
+    }
+
+    // Large entries are compressed in parallel, small ones are not worth starting threads for.
     int method = flags & DontCompress ? Z_NULL : Z_DEFLATED;
-    int level = flags & DontCompress ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION;
-    uLong UTF8_encoding = 1 << 11; // general purpose bit 11 for unicode
+    int level = flags & DontCompress ? Z_NO_COMPRESSION : (CONF(zipCompressionLevel));
+    unsigned int threads = 1;
+    if(method == Z_DEFLATED)
+    {
+        int conf = CONF(zipThreads);
+        threads = conf > 0 ? unsigned(conf) : max(thread::hardware_concurrency(), 1U);
+        is.clear();
+        is.seekg(0, istream::end);
+        istream::pos_type pos = is.tellg();
+        if(pos == istream::pos_type(-1) || size_t(pos) <= Private::DEFLATE_BLOCK * 2)
+            threads = 1;
+    }
+
+    // Create new file inside ZIP container.
     int zipResult = zipOpenNewFileInZip4(d->create, containerPath.c_str(),
-        &info, nullptr, 0, nullptr, 0, prop.comment.c_str(), method, level, 0,
+        &info, nullptr, 0, nullptr, 0, prop.comment.c_str(), method, level, threads > 1 ? 1 : 0,
         -MAX_WBITS, DEF_MEM_LEVEL, Z_DEFAULT_STRATEGY, nullptr, 0, 0, UTF8_encoding);
     if(zipResult != ZIP_OK)
         THROW("Failed to create new file inside ZIP container. ZLib error: %d", zipResult);
 
     is.clear();
     is.seekg(0);
+    if(threads > 1)
+    {
+        DEBUG("ZipSerialize::addFile(%s) deflate with %u threads", containerPath.c_str(), threads);
+        uLong crc = 0;
+        ZPOS64_T size = 0;
+        try
+        {
+            d->deflateParallel(is, level, threads, crc, size);
+        }
+        catch(const Exception &)
+        {
+            zipCloseFileInZipRaw64(d->create, size, crc);
+            throw;
+        }
+        zipResult = zipCloseFileInZipRaw64(d->create, size, crc);
+        if(zipResult != ZIP_OK)
+            THROW("Failed to close current file inside ZIP container. ZLib error: %d", zipResult);
+        return;
+    }
+
     char buf[10240];
     while( is )
     {
@@ -218,30 +889,20 @@ void ZipSerialize::addFile(const string& containerPath, istream &is, const Prope
 
 ZipSerialize::Properties ZipSerialize::properties(const string &file) const
 {
-    int unzResult = unzLocateFile(d->open, file.c_str(), 1);
-    if(unzResult != UNZ_OK)
-        THROW("Failed to open file inside ZIP container. ZLib error: %d", unzResult);
-
-    unz_file_info info;
-    unzResult = unzGetCurrentFileInfo(d->open, &info, nullptr, 0, nullptr, 0, nullptr, 0);
-    if(unzResult != UNZ_OK)
-        THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
+    if(d->create)
+        THROW("Zip file is not open");
 
+    lock_guard<mutex> guard(d->lock);
+    d->openReader();
+    const Private::Entry &e = d->entry(file);
     Properties prop;
-    prop.time = { int(info.tmu_date.tm_sec), int(info.tmu_date.tm_min), int(info.tmu_date.tm_hour),
-            int(info.tmu_date.tm_mday), int(info.tmu_date.tm_mon), int(info.tmu_date.tm_year), 0, 0, 0
+    prop.comment = e.comment;
+    prop.time = { int(e.time.tm_sec), int(e.time.tm_min), int(e.time.tm_hour),
+            int(e.time.tm_mday), int(e.time.tm_mon), int(e.time.tm_year), 0, 0, 0
 #ifndef _WIN32
              , 0, nullptr
 #endif
     };
-    prop.size = info.uncompressed_size;
-    if(info.size_file_comment == 0)
-        return prop;
-
-    prop.comment.resize(info.size_file_comment);
-    unzResult = unzGetCurrentFileInfo(d->open, &info, nullptr, 0, nullptr, 0, &prop.comment[0], uLong(prop.comment.size()));
-    if(unzResult != UNZ_OK)
-        THROW("Failed to get filename of the current file inside ZIP container. ZLib error: %d", unzResult);
-
+    prop.size = (unsigned long)e.size;
     return prop;
 }
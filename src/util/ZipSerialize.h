@@ -21,6 +21,7 @@
 
 #include "Exports.h"
 
+#include <memory>
 #include <string>
 #include <vector>
 #ifdef __ANDROID__
@@ -38,17 +39,20 @@ namespace digidoc
       public:
           struct Properties { std::string comment; tm time; unsigned long size; };
           enum Flags { NoFlags = 0, DontCompress = 1 };
-          ZipSerialize(std::string path, bool create);
+          ZipSerialize(std::string path, bool create, bool append = false);
           ~ZipSerialize();
 
+          void close();
+          void save();
           std::vector<std::string> list() const;
           void extract(const std::string &file, std::ostream &os) const;
+          std::unique_ptr<std::istream> stream(const std::string &file) const;
           void addFile(const std::string &containerPath, std::istream &is, const Properties &prop, Flags flags = NoFlags);
           Properties properties(const std::string &file) const;
 
       private:
           DISABLE_COPY(ZipSerialize);
           class Private;
-          Private *d;
+          std::shared_ptr<Private> d;
     };
 }
@@ -27,6 +27,7 @@ DIGIDOCPP_WARNING_DISABLE_CLANG("-Wnull-conversion")
 DIGIDOCPP_WARNING_DISABLE_GCC("-Wunused-parameter")
 DIGIDOCPP_WARNING_DISABLE_MSVC(4005)
 #include <xercesc/framework/Wrapper4InputSource.hpp>
+#include <xercesc/internal/XMLGrammarPoolImpl.hpp>
 #include <xsd/cxx/tree/error-handler.hxx>
 #include <xsd/cxx/xml/dom/bits/error-handler-proxy.hxx>
 #include <xsd/cxx/xml/sax/std-input-source.hxx>
@@ -34,6 +35,8 @@ DIGIDOCPP_WARNING_DISABLE_MSVC(4005)
 #include <xsec/dsig/DSIGReference.hpp>
 DIGIDOCPP_WARNING_POP
 
+#include <map>
+#include <mutex>
 #include <sstream>
 
 using namespace digidoc;
@@ -46,6 +49,7 @@ SecureDOMParser::SecureDOMParser(const string &schema_location)
 {}
 
 SecureDOMParser::SecureDOMParser(const string &schema_location, bool dont_validate)
+    : DOMLSParserImpl(nullptr, XMLPlatformUtils::fgMemoryManager, grammarPool(schema_location, dont_validate))
 {
     DOMConfiguration *conf = getDomConfig();
     // Discard comment nodes in the document.
@@ -83,6 +87,76 @@ SecureDOMParser::SecureDOMParser(const string &schema_location, bool dont_valida
     // schemas via the schema location attributes in the document.
     if(!schema_location.empty())
         conf->setParameter(XMLUni::fgXercesLoadSchema, false);
+    // Use preloaded grammars from shared read-only pool.
+    if(getGrammarPool() && !dont_validate)
+    {
+        conf->setParameter(XMLUni::fgXercesUseCachedGrammarInParse, true);
+        conf->setParameter(XMLUni::fgXercesCacheGrammarFromParse, false);
+    }
+}
+
+static mutex grammarLock;
+static map<string,unique_ptr<XMLGrammarPool>> grammarCache;
+
+/**
+ * Returns process wide grammar pool for <code>schema_location</code>. Pool is created on first
+ * use, all schemas listed in schema location are loaded into it and pool is locked, so it can
+ * be shared by parsers on different threads without reloading grammars on every parse.
+ * Pools are keyed by schema location, because strict and relaxed XAdES schemas share namespace.
+ * Failed load is cached as empty pool, so it is not retried and reported on every parse.
+ */
+XMLGrammarPool* SecureDOMParser::grammarPool(const string &schema_location, bool dont_validate)
+{
+    if(dont_validate || schema_location.empty())
+        return nullptr;
+    lock_guard<mutex> lock(grammarLock);
+    map<string,unique_ptr<XMLGrammarPool>>::const_iterator i = grammarCache.find(schema_location);
+    if(i != grammarCache.cend())
+        return i->second.get();
+    unique_ptr<XMLGrammarPool> &pool = grammarCache[schema_location];
+
+    DEBUG("SecureDOMParser::grammarPool(%s)", schema_location.c_str());
+    unique_ptr<XMLGrammarPool> result(new XMLGrammarPoolImpl(XMLPlatformUtils::fgMemoryManager));
+    {
+        DOMLSParserImpl loader(nullptr, XMLPlatformUtils::fgMemoryManager, result.get());
+        DOMConfiguration *conf = loader.getDomConfig();
+        conf->setParameter(XMLUni::fgDOMNamespaces, true);
+        conf->setParameter(XMLUni::fgXercesSchema, true);
+        conf->setParameter(XMLUni::fgXercesSchemaFullChecking, false);
+        conf->setParameter(XMLUni::fgXercesHandleMultipleImports, true);
+        xsd::cxx::tree::error_handler<char> eh;
+        xml::dom::bits::error_handler_proxy<char> ehp(eh);
+        conf->setParameter(XMLUni::fgDOMErrorHandler, &ehp);
+
+        // Schema location is a list of namespace and location pairs
+        istringstream is(schema_location);
+        string ns, location;
+        while(is >> ns >> location)
+        {
+            if(!loader.loadGrammar(location.c_str(), Grammar::SchemaGrammarType, true))
+            {
+                WARN("Failed to load schema '%s', using uncached schema validation", location.c_str());
+                return nullptr;
+            }
+        }
+        if(ehp.failed())
+        {
+            WARN("Failed to load schemas '%s', using uncached schema validation", schema_location.c_str());
+            return nullptr;
+        }
+    }
+    result->lockPool();
+    pool = move(result);
+    return pool.get();
+}
+
+/**
+ * Releases cached grammars, must be called before Xerces is terminated.
+ */
+void SecureDOMParser::clearGrammarCache()
+{
+    lock_guard<mutex> lock(grammarLock);
+    grammarCache.clear();
 }
 
 void SecureDOMParser::calcDigestOnNode(Digest *calc,
@@ -113,10 +187,12 @@ void SecureDOMParser::calcDigestOnNode(Digest *calc,
         THROW("Unsupported canonicalization method '%s'", algorithmType.c_str());
     }
 
-    unsigned char buffer[1024];
+    // Canonicalizer fills the buffer node by node, stream it straight to digest in
+    // large blocks to keep the number of calls low for nodes like RevocationValues.
+    vector<unsigned char> buffer(64 * 1024);
     XMLSize_t bytes = 0;
-    while((bytes = c14n.outputBuffer(buffer, 1024)) > 0)
-        calc->update(buffer, bytes);
+    while((bytes = c14n.outputBuffer(buffer.data(), XMLSize_t(buffer.size()))) > 0)
+        calc->update(buffer.data(), bytes);
 }
 
 void SecureDOMParser::doctypeDecl(const DTDElementDecl& root,
@@ -35,6 +35,7 @@ public:
 
     static void calcDigestOnNode(Digest *calc, const std::string &algorithmType,
         xercesc::DOMDocument *doc, xercesc::DOMNode *node);
+    static void clearGrammarCache();
 
     void doctypeDecl(const xercesc::DTDElementDecl& root,
                const XMLCh* const             public_id,
@@ -43,6 +44,9 @@ public:
                const bool                     has_external) final;
 
     std::unique_ptr<xercesc::DOMDocument> parseIStream(std::istream &is);
+
+private:
+    static xercesc::XMLGrammarPool* grammarPool(const std::string &schema_location, bool dont_validate);
 };
 
 }
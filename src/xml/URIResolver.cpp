@@ -38,10 +38,15 @@ using namespace xercesc;
 using namespace digidoc;
 using namespace digidoc::util;
 
+/**
+ * Reads document stream shared by the container. Document is locked while the stream
+ * exists, so that concurrent signature validations do not move each others read position.
+ */
 class IStreamInputStream: public BinInputStream
 {
 public:
-    explicit IStreamInputStream(istream *is): is_(is)
+    explicit IStreamInputStream(const DataFilePrivate *file)
+        : lock_(file->m_lock), is_(file->m_is.get())
     {
         is_->clear();
         is_->seekg(0);
@@ -63,6 +68,7 @@ public:
         return nullptr;
     }
 
+    unique_lock<mutex> lock_;
     istream *is_;
 };
 
@@ -83,7 +89,7 @@ BinInputStream* URIResolver::resolveURI(const XMLCh *uri)
     for(const DataFile *file: doc_->dataFiles())
     {
         if(file->fileName() == File::fromUriPath(_uri))
-            return new IStreamInputStream(static_cast<const DataFilePrivate*>(file)->m_is.get());
+            return new IStreamInputStream(static_cast<const DataFilePrivate*>(file));
     }
 
     if(doc_->mediaType() == ASiC_E::MIMETYPE_ADOC)
@@ -92,7 +98,7 @@ BinInputStream* URIResolver::resolveURI(const XMLCh *uri)
         for(const DataFile *file: adoc->metaFiles())
         {
             if(file->fileName() == File::fromUriPath(_uri))
-                return new IStreamInputStream(static_cast<const DataFilePrivate*>(file)->m_is.get());
+                return new IStreamInputStream(static_cast<const DataFilePrivate*>(file));
         }
     }
 
@@ -22,12 +22,35 @@
 
 #include <boost/mpl/list.hpp>
 
+#include <atomic>
+#include <csignal>
+#include <future>
+#include <thread>
+
 #include <DataFile.h>
 #include <Signature.h>
 #include <XmlConf.h>
+#include <crypto/Connect.h>
+#include <crypto/Digest.h>
+#include <crypto/PKCS11Signer.h>
 #include <crypto/PKCS12Signer.h>
+#include <crypto/X509CertStore.h>
 #include <crypto/X509Crypto.h>
 #include <util/DateTime.h>
+#include <util/ThreadPool.h>
+#include <util/ZipSerialize.h>
+
+#include <openssl/x509v3.h>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+#if defined(SOFTHSM_MODULE) && !defined(_WIN32)
+#include <crypto/pkcs11.h>
+#include <dlfcn.h>
+#endif
 
 namespace digidoc
 {
@@ -56,6 +79,320 @@ const string ASiCE::TYPE = "application/vnd.etsi.asic-e+zip";
 const string ASiCE::EXT = "asice";
 const string ASiCS::TYPE = "application/vnd.etsi.asic-s+zip";
 const string ASiCS::EXT = "asics";
+
+struct ZipEntry
+{
+    string name;
+    unsigned long method, crc, offset;
+};
+
+string fileContent(const string &path)
+{
+    ifstream f(util::File::encodeName(path).c_str(), ifstream::binary);
+    return string(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+}
+
+/**
+ * Lists central directory records of ZIP archive <code>data</code>, <code>directory</code>
+ * is set to central directory offset.
+ */
+vector<ZipEntry> zipEntries(const string &data, size_t &directory)
+{
+    auto le = [&data](size_t pos, size_t size) {
+        unsigned long value = 0;
+        for(size_t i = size; i > 0 && pos + i <= data.size(); --i)
+            value = value << 8 | (unsigned char)data[pos + i - 1];
+        return value;
+    };
+    vector<ZipEntry> result;
+    size_t eocd = data.rfind(string("PK\5\6", 4));
+    if(eocd == string::npos)
+        return result;
+    directory = le(eocd + 16, 4);
+    for(size_t pos = directory; data.compare(pos, 4, string("PK\1\2", 4)) == 0;
+        pos += 46 + le(pos + 28, 2) + le(pos + 30, 2) + le(pos + 32, 2))
+        result.push_back({ data.substr(pos + 46, le(pos + 28, 2)), le(pos + 10, 2), le(pos + 16, 4), le(pos + 42, 4) });
+    return result;
+}
+
+/**
+ * Creates self signed certificate with issuer name <code>issuer</code> and optional
+ * Authority Key Identifier <code>keyid</code>.
+ */
+X509Cert issuedCert(X509_NAME *issuer, const vector<unsigned char> &keyid = {})
+{
+    EVP_PKEY *key = nullptr;
+    unique_ptr<EVP_PKEY_CTX,decltype(&EVP_PKEY_CTX_free)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+    EVP_PKEY_keygen_init(ctx.get());
+    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1);
+    EVP_PKEY_keygen(ctx.get(), &key);
+    unique_ptr<EVP_PKEY,decltype(&EVP_PKEY_free)> pkey(key, EVP_PKEY_free);
+
+    unique_ptr<X509,decltype(&X509_free)> cert(X509_new(), X509_free);
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+    X509_set_issuer_name(cert.get(), issuer);
+    unique_ptr<X509_NAME,decltype(&X509_NAME_free)> subject(X509_NAME_new(), X509_NAME_free);
+    X509_NAME_add_entry_by_txt(subject.get(), "CN", MBSTRING_UTF8, (const unsigned char*)"issuedCert", -1, -1, 0);
+    X509_set_subject_name(cert.get(), subject.get());
+    X509_gmtime_adj(X509_get_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert.get()), 3600);
+    X509_set_pubkey(cert.get(), pkey.get());
+    if(!keyid.empty())
+    {
+        unique_ptr<AUTHORITY_KEYID,decltype(&AUTHORITY_KEYID_free)> akid(AUTHORITY_KEYID_new(), AUTHORITY_KEYID_free);
+        akid->keyid = ASN1_OCTET_STRING_new();
+        ASN1_OCTET_STRING_set(akid->keyid, keyid.data(), int(keyid.size()));
+        X509_add1_ext_i2d(cert.get(), NID_authority_key_identifier, akid.get(), 0, X509V3_ADD_DEFAULT);
+    }
+    X509_sign(cert.get(), pkey.get(), EVP_sha256());
+    return X509Cert(cert.get());
+}
+
+#ifndef _WIN32
+/**
+ * Minimal HTTP/1.1 server on loopback interface. Answers every request with keep-alive response
+ * containing request sequence number. After <code>closeAfter</code> responses next request on same
+ * connection is dropped and connection is closed, as server closing idle connection would do.
+ */
+class HTTPServer
+{
+public:
+    explicit HTTPServer(int closeAfter)
+        : fd(socket(AF_INET, SOCK_STREAM, 0))
+    {
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t size = sizeof(addr);
+        bind(fd, (sockaddr*)&addr, size);
+        listen(fd, 4);
+        getsockname(fd, (sockaddr*)&addr, &size);
+        port = ntohs(addr.sin_port);
+        t = thread([=]{
+            int c = -1;
+            while((c = accept(fd, nullptr, nullptr)) >= 0)
+            {
+                ++connections;
+                for(int i = 0; serve(c, i < closeAfter); ++i);
+                close(c);
+            }
+        });
+    }
+
+    ~HTTPServer()
+    {
+        shutdown(fd, SHUT_RDWR);
+        t.join();
+        close(fd);
+    }
+
+    int port = 0;
+    atomic<int> connections{0}, requests{0};
+
+private:
+    bool serve(int c, bool respond)
+    {
+        string data;
+        char buf[1024];
+        size_t pos = 0;
+        ssize_t rc = 0;
+        while((pos = data.find("\r\n\r\n")) == string::npos && (rc = recv(c, buf, sizeof(buf), 0)) > 0)
+            data.append(buf, size_t(rc));
+        if(pos == string::npos)
+            return false;
+        size_t len = 0, header = data.find("Content-Length: ");
+        if(header < pos)
+            len = strtoul(data.c_str() + header + 16, nullptr, 10);
+        while(data.size() < pos + 4 + len && (rc = recv(c, buf, sizeof(buf), 0)) > 0)
+            data.append(buf, size_t(rc));
+        if(!respond)
+            return false;
+        string content = to_string(++requests);
+        string response = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(content.size()) +
+            "\r\nKeep-Alive: timeout=30\r\n\r\n" + content;
+        return send(c, response.c_str(), response.size(), MSG_NOSIGNAL) == ssize_t(response.size());
+    }
+
+    int fd;
+    thread t;
+};
+#endif
+
+#if defined(SOFTHSM_MODULE) && !defined(_WIN32)
+/**
+ * SoftHSM token with EC key and non-repudiation certificate. Token is stored in
+ * <code>path</code>/softhsm and reinitialized on each construction.
+ */
+class SoftHSMToken
+{
+public:
+    explicit SoftHSMToken(const string &path)
+    {
+        util::File::createDirectory(path + "/softhsm");
+        ofstream(util::File::encodeName(path + "/softhsm2.conf").c_str()) << "directories.tokendir = " << path << "/softhsm\n";
+        setenv("SOFTHSM2_CONF", (path + "/softhsm2.conf").c_str(), 1);
+
+        EVP_PKEY *key = nullptr;
+        unique_ptr<EVP_PKEY_CTX,decltype(&EVP_PKEY_CTX_free)> ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr), EVP_PKEY_CTX_free);
+        EVP_PKEY_keygen_init(ctx.get());
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx.get(), NID_X9_62_prime256v1);
+        EVP_PKEY_keygen(ctx.get(), &key);
+        unique_ptr<EVP_PKEY,decltype(&EVP_PKEY_free)> pkey(key, EVP_PKEY_free);
+
+        unique_ptr<X509,decltype(&X509_free)> x509(X509_new(), X509_free);
+        X509_set_version(x509.get(), 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(x509.get()), 1);
+        unique_ptr<X509_NAME,decltype(&X509_NAME_free)> subject(X509_NAME_new(), X509_NAME_free);
+        X509_NAME_add_entry_by_txt(subject.get(), "CN", MBSTRING_UTF8, (const unsigned char*)"SoftHSMToken", -1, -1, 0);
+        X509_set_subject_name(x509.get(), subject.get());
+        X509_set_issuer_name(x509.get(), subject.get());
+        X509_gmtime_adj(X509_get_notBefore(x509.get()), -60);
+        X509_gmtime_adj(X509_get_notAfter(x509.get()), 3600);
+        X509_set_pubkey(x509.get(), pkey.get());
+        X509_EXTENSION *usage = X509V3_EXT_conf_nid(nullptr, nullptr, NID_key_usage, const_cast<char*>("critical,nonRepudiation"));
+        X509_add_ext(x509.get(), usage, -1);
+        X509_EXTENSION_free(usage);
+        X509_sign(x509.get(), pkey.get(), EVP_sha256());
+        cert = X509Cert(x509.get());
+
+        vector<CK_BYTE> der = cert, name(size_t(i2d_X509_NAME(subject.get(), nullptr)));
+        unsigned char *p = name.data();
+        i2d_X509_NAME(subject.get(), &p);
+        const BIGNUM *priv = EC_KEY_get0_private_key(EVP_PKEY_get0_EC_KEY(pkey.get()));
+        vector<CK_BYTE> value(32, 0);
+        BN_bn2bin(priv, &value[value.size() - size_t(BN_num_bytes(priv))]);
+        // DER encoded prime256v1 OID
+        vector<CK_BYTE> params{ 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07 }, id{ 0x01 };
+
+        if(!(f = module()))
+            return;
+        string label = LABEL;
+        label.resize(32, ' ');
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+        CK_OBJECT_HANDLE obj = CK_INVALID_HANDLE;
+        CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY, certClass = CKO_CERTIFICATE;
+        CK_KEY_TYPE keyType = CKK_EC;
+        CK_CERTIFICATE_TYPE certType = CKC_X_509;
+        CK_BBOOL _true = CK_TRUE;
+        vector<CK_ATTRIBUTE> keyAttrs {
+            { CKA_CLASS, &keyClass, sizeof(keyClass) },
+            { CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+            { CKA_TOKEN, &_true, sizeof(_true) },
+            { CKA_PRIVATE, &_true, sizeof(_true) },
+            { CKA_SIGN, &_true, sizeof(_true) },
+            { CKA_ID, id.data(), CK_ULONG(id.size()) },
+            { CKA_EC_PARAMS, params.data(), CK_ULONG(params.size()) },
+            { CKA_VALUE, value.data(), CK_ULONG(value.size()) }
+        };
+        vector<CK_ATTRIBUTE> certAttrs {
+            { CKA_CLASS, &certClass, sizeof(certClass) },
+            { CKA_CERTIFICATE_TYPE, &certType, sizeof(certType) },
+            { CKA_TOKEN, &_true, sizeof(_true) },
+            { CKA_ID, id.data(), CK_ULONG(id.size()) },
+            { CKA_SUBJECT, name.data(), CK_ULONG(name.size()) },
+            { CKA_VALUE, der.data(), CK_ULONG(der.size()) }
+        };
+        // Reuses token from previous run or initializes free slot
+        if((rv = findSlot(label, true)) != CKR_OK && (rv = findSlot(string(), false)) != CKR_OK)
+            return;
+        if((rv = f->C_InitToken(slot, CK_UTF8CHAR_PTR(SO_PIN), CK_ULONG(strlen(SO_PIN)), CK_UTF8CHAR_PTR(label.data()))) != CKR_OK ||
+            (rv = findSlot(label, true)) != CKR_OK ||
+            (rv = f->C_OpenSession(slot, CKF_SERIAL_SESSION|CKF_RW_SESSION, nullptr, nullptr, &session)) != CKR_OK)
+            return;
+        if((rv = f->C_Login(session, CKU_SO, CK_UTF8CHAR_PTR(SO_PIN), CK_ULONG(strlen(SO_PIN)))) == CKR_OK &&
+            (rv = f->C_InitPIN(session, CK_UTF8CHAR_PTR(PIN), CK_ULONG(strlen(PIN)))) == CKR_OK &&
+            (rv = f->C_Logout(session)) == CKR_OK &&
+            (rv = f->C_Login(session, CKU_USER, CK_UTF8CHAR_PTR(PIN), CK_ULONG(strlen(PIN)))) == CKR_OK &&
+            (rv = f->C_CreateObject(session, keyAttrs.data(), CK_ULONG(keyAttrs.size()), &obj)) == CKR_OK &&
+            (rv = f->C_CreateObject(session, certAttrs.data(), CK_ULONG(certAttrs.size()), &obj)) == CKR_OK)
+            rv = f->C_Logout(session);
+        f->C_CloseSession(session);
+        f->C_Finalize(nullptr);
+    }
+
+    ~SoftHSMToken()
+    {
+        if(h)
+            dlclose(h);
+    }
+
+    /**
+     * Logs out token, login state is shared by all sessions of application.
+     */
+    bool logout()
+    {
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+        if(!module() || f->C_OpenSession(slot, CKF_SERIAL_SESSION, nullptr, nullptr, &session) != CKR_OK)
+            return false;
+        CK_RV result = f->C_Logout(session);
+        f->C_CloseSession(session);
+        return result == CKR_OK;
+    }
+
+    static constexpr const char *LABEL = "libdigidocpp";
+    static constexpr const char *PIN = "1234";
+    static constexpr const char *SO_PIN = "12345678";
+    X509Cert cert;
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+private:
+    CK_RV findSlot(const string &label, bool initialized)
+    {
+        CK_ULONG size = 0;
+        if(f->C_GetSlotList(CK_FALSE, nullptr, &size) != CKR_OK)
+            return CKR_GENERAL_ERROR;
+        vector<CK_SLOT_ID> slots(size);
+        if(size && f->C_GetSlotList(CK_FALSE, slots.data(), &size) != CKR_OK)
+            return CKR_GENERAL_ERROR;
+        for(CK_SLOT_ID id: slots)
+        {
+            CK_TOKEN_INFO token;
+            if(f->C_GetTokenInfo(id, &token) != CKR_OK ||
+                bool(token.flags & CKF_TOKEN_INITIALIZED) != initialized ||
+                (initialized && label.compare(0, 32, (const char*)token.label, 32) != 0))
+                continue;
+            slot = id;
+            return CKR_OK;
+        }
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    /**
+     * Loads module, it is already initialized while PKCS11Signer is using it.
+     */
+    CK_FUNCTION_LIST *module()
+    {
+        if(!h && !(h = dlopen(SOFTHSM_MODULE, RTLD_LAZY)))
+            return nullptr;
+        CK_C_GetFunctionList l = CK_C_GetFunctionList(dlsym(h, "C_GetFunctionList"));
+        CK_FUNCTION_LIST *list = nullptr;
+        if(!l || l(&list) != CKR_OK)
+            return nullptr;
+        CK_RV result = list->C_Initialize(nullptr);
+        return result == CKR_OK || result == CKR_CRYPTOKI_ALREADY_INITIALIZED ? (f = list) : nullptr;
+    }
+
+    void *h = nullptr;
+    CK_FUNCTION_LIST *f = nullptr;
+    CK_SLOT_ID slot = 0;
+};
+
+/**
+ * Counts PIN requests, PIN is requested only for new login.
+ */
+class SoftHSMSigner: public PKCS11Signer
+{
+public:
+    SoftHSMSigner(): PKCS11Signer(SOFTHSM_MODULE) {}
+    string pin(const X509Cert & /*certificate*/) const override
+    {
+        ++pinRequests;
+        return SoftHSMToken::PIN;
+    }
+    mutable atomic<unsigned int> pinRequests{0};
+};
+#endif
 }
 
 
@@ -117,6 +454,87 @@ BOOST_AUTO_TEST_CASE(signerParameters)
 }
 BOOST_AUTO_TEST_SUITE_END()
 
+#if defined(SOFTHSM_MODULE) && !defined(_WIN32)
+BOOST_AUTO_TEST_SUITE(PKCS11SignerSuite)
+BOOST_AUTO_TEST_CASE(sessionReuse)
+{
+    SoftHSMToken token(".");
+    BOOST_REQUIRE_EQUAL(token.rv, CKR_OK);
+    vector<unsigned char> digest(32, 0x5A);
+    {
+        SoftHSMSigner signer;
+        const Signer &s = signer;
+        X509Cert cert = s.cert();
+        BOOST_CHECK_EQUAL(cert, token.cert);
+        for(unsigned int i = 0; i < 2; ++i)
+            BOOST_CHECK(digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)));
+        // Session is closed after each signature by default
+        BOOST_CHECK_EQUAL(signer.pinRequests.load(), 2U);
+    }
+
+    SoftHSMSigner signer;
+    signer.setMaxSessions(1);
+    const Signer &s = signer;
+    X509Cert cert = s.cert();
+    for(unsigned int i = 0; i < 2; ++i)
+        BOOST_CHECK(digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)));
+    BOOST_CHECK_EQUAL(signer.pinRequests.load(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(loginRetry)
+{
+    SoftHSMToken token(".");
+    BOOST_REQUIRE_EQUAL(token.rv, CKR_OK);
+    vector<unsigned char> digest(32, 0x5A);
+    SoftHSMSigner signer;
+    signer.setMaxSessions(1);
+    const Signer &s = signer;
+    X509Cert cert = s.cert();
+    BOOST_CHECK(digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)));
+    BOOST_CHECK_EQUAL(signer.pinRequests.load(), 1U);
+    BOOST_CHECK(digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)));
+    BOOST_CHECK_EQUAL(signer.pinRequests.load(), 1U);
+
+    // Pooled session fails with CKR_USER_NOT_LOGGED_IN and is replaced with new logged in session
+    BOOST_REQUIRE(token.logout());
+    BOOST_CHECK(digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)));
+    BOOST_CHECK_EQUAL(signer.pinRequests.load(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(concurrentSessions)
+{
+    SoftHSMToken token(".");
+    BOOST_REQUIRE_EQUAL(token.rv, CKR_OK);
+    vector<unsigned char> digest(32, 0x5A);
+    SoftHSMSigner signer;
+    signer.setMaxSessions(2);
+    const Signer &s = signer;
+    X509Cert cert = s.cert();
+    // Pooled sessions share token login, Boost.Test checks are done on main thread
+    vector<future<unsigned int>> results;
+    for(unsigned int i = 0; i < 4; ++i)
+    {
+        results.push_back(async(launch::async, [&] {
+            unsigned int failed = 0;
+            for(unsigned int j = 0; j < 10; ++j)
+            {
+                try {
+                    if(!digidoc::X509Crypto(cert).verify(URI_ECDSA_SHA256, digest, s.sign(URI_ECDSA_SHA256, digest)))
+                        ++failed;
+                } catch(const Exception &) {
+                    ++failed;
+                }
+            }
+            return failed;
+        }));
+    }
+    for(future<unsigned int> &result: results)
+        BOOST_CHECK_EQUAL(result.get(), 0U);
+    BOOST_CHECK_EQUAL(signer.pinRequests.load(), 1U);
+}
+BOOST_AUTO_TEST_SUITE_END()
+#endif
+
 BOOST_AUTO_TEST_SUITE(X509CertSuite)
 BOOST_AUTO_TEST_CASE(parameters)
 {
@@ -138,6 +556,75 @@ BOOST_AUTO_TEST_CASE(parameters)
 }
 BOOST_AUTO_TEST_SUITE_END()
 
+BOOST_AUTO_TEST_SUITE(X509CertStoreSuite)
+BOOST_AUTO_TEST_CASE(findIssuer)
+{
+    X509Cert inter("inter.crt", X509Cert::Pem);
+    X509_NAME *interName = X509_get_subject_name(inter.handle());
+
+    // Authority Key Identifier matches Subject Key Identifier
+    unique_ptr<Signer> signer1(new PKCS12Signer("signer1.p12", "signer1"));
+    BOOST_CHECK_EQUAL(X509CertStore::instance()->findIssuer(signer1->cert(), X509CertStore::CA), inter);
+    BOOST_CHECK_EQUAL(!X509CertStore::instance()->findIssuer(signer1->cert(), X509CertStore::OCSP), true);
+    BOOST_CHECK_EQUAL(X509CertStore::instance()->findIssuer(issuedCert(interName, {
+        0x5A, 0x9F, 0xFF, 0xD8, 0x6D, 0xB8, 0x45, 0x5C, 0x4C, 0xD8,
+        0x63, 0x39, 0xFF, 0xA9, 0x89, 0xF6, 0x56, 0x2A, 0xD8, 0xF1 }), X509CertStore::CA), inter);
+    // Key identifier takes precedence over matching issuer name
+    BOOST_CHECK_EQUAL(!X509CertStore::instance()->findIssuer(issuedCert(interName, { 0x01, 0x02, 0x03 }), X509CertStore::CA), true);
+
+    // Without Authority Key Identifier issuer is found by subject name
+    BOOST_CHECK_EQUAL(X509CertStore::instance()->findIssuer(issuedCert(interName), X509CertStore::CA), inter);
+    // Unknown issuer name must not match any certificate in store
+    unique_ptr<X509_NAME,decltype(&X509_NAME_free)> unknown(X509_NAME_new(), X509_NAME_free);
+    X509_NAME_add_entry_by_txt(unknown.get(), "C", MBSTRING_UTF8, (const unsigned char*)"EE", -1, -1, 0);
+    X509_NAME_add_entry_by_txt(unknown.get(), "CN", MBSTRING_UTF8, (const unsigned char*)"libdigidocpp Unknown", -1, -1, 0);
+    BOOST_CHECK_EQUAL(!X509CertStore::instance()->findIssuer(issuedCert(unknown.get()), X509CertStore::CA), true);
+}
+
+BOOST_AUTO_TEST_CASE(sharedStore)
+{
+    unique_ptr<Signer> signer1(new PKCS12Signer("signer1.p12", "signer1"));
+    X509Cert inter("inter.crt", X509Cert::Pem);
+    X509Cert forged = issuedCert(X509_get_subject_name(inter.handle()));
+    unique_ptr<X509_NAME,decltype(&X509_NAME_free)> unknown(X509_NAME_new(), X509_NAME_free);
+    X509_NAME_add_entry_by_txt(unknown.get(), "CN", MBSTRING_UTF8, (const unsigned char*)"libdigidocpp Unknown", -1, -1, 0);
+    X509Cert unknownIssuer = issuedCert(unknown.get());
+
+    // Prebuilt store is shared by concurrent verifications, Boost.Test checks are done on main thread
+    X509Cert signer = signer1->cert();
+    vector<future<unsigned int>> results;
+    for(unsigned int i = 0; i < 4; ++i)
+    {
+        results.push_back(async(launch::async, [&] {
+            unsigned int failed = 0;
+            for(unsigned int j = 0; j < 20; ++j)
+            {
+                try {
+                    if(!X509CertStore::instance()->verify(signer, true))
+                        ++failed;
+                } catch(const Exception &) {
+                    ++failed;
+                }
+                try {
+                    X509CertStore::instance()->verify(forged, true);
+                    ++failed;
+                } catch(const Exception &) {}
+                try {
+                    X509CertStore::instance()->verify(unknownIssuer, true);
+                    ++failed;
+                } catch(const Exception &e) {
+                    if(e.code() != Exception::CertificateIssuerMissing)
+                        ++failed;
+                }
+            }
+            return failed;
+        }));
+    }
+    for(future<unsigned int> &result: results)
+        BOOST_CHECK_EQUAL(result.get(), 0U);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_AUTO_TEST_SUITE(X509Crypto)
 BOOST_AUTO_TEST_CASE(parameters)
 {
@@ -287,6 +774,10 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(signature, Doc, DocTypes)
         BOOST_CHECK_EQUAL(d->signatures().at(1)->signingCertificate(), signer2->cert());
         BOOST_CHECK_NO_THROW(d->signatures().at(1)->validate());
     }
+    vector<unique_ptr<Signature::Validator>> results = Signature::Validator::validateAll(d->signatures(), 2);
+    BOOST_CHECK_EQUAL(results.size(), d->signatures().size());
+    for(const unique_ptr<Signature::Validator> &v: results)
+        BOOST_CHECK_EQUAL(v->status(), Signature::Validator::Valid);
     BOOST_CHECK_NO_THROW(d->save());
 
     // Remove first Signature
@@ -377,6 +868,10 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(signature, Doc, DocTypes)
         Signature *s4 = nullptr;
         BOOST_CHECK_NO_THROW(s4 = d->sign(signer4.get()));
         BOOST_CHECK_EQUAL(s4->signatureMethod(), "http://www.w3.org/2001/04/xmldsig-more#ecdsa-sha384");
+        future<Signature*> f = d->signAsync(signer4.get());
+        BOOST_CHECK_NO_THROW(s4 = f.get());
+        BOOST_CHECK_EQUAL(d->signatures().size(), 2U);
+        BOOST_CHECK_EQUAL(s4->signingCertificate(), signer4->cert());
     }
 
     // Remove second Signature
@@ -384,6 +879,99 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(signature, Doc, DocTypes)
     BOOST_CHECK_EQUAL(d->signatures().size(), 0U);
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(appendSignature, Doc, DocTypes)
+{
+    unique_ptr<Container> d = Container::createPtr(Doc::EXT + "-append.tmp");
+    BOOST_CHECK_NO_THROW(d->addDataFile("test1.txt", "text/plain"));
+    unique_ptr<Signer> signer1(new PKCS12Signer("signer1.p12", "signer1"));
+    BOOST_CHECK_NO_THROW(d->sign(signer1.get()));
+    BOOST_CHECK_NO_THROW(d->save());
+
+    string before = fileContent(Doc::EXT + "-append.tmp");
+    size_t directory = 0;
+    vector<ZipEntry> entriesBefore = zipEntries(before, directory);
+
+    // Second signature is appended to the end of opened container
+    d = Container::openPtr(Doc::EXT + "-append.tmp");
+    unique_ptr<Signer> signer2(new PKCS12Signer("signer2.p12", "signer2"));
+    BOOST_CHECK_NO_THROW(d->sign(signer2.get()));
+    BOOST_CHECK_NO_THROW(d->save());
+    // Nothing to append
+    BOOST_CHECK_NO_THROW(d->save());
+
+    // Existing entries are left in place, new signature is written over old central directory
+    string after = fileContent(Doc::EXT + "-append.tmp");
+    size_t directoryAfter = 0;
+    vector<ZipEntry> entriesAfter = zipEntries(after, directoryAfter);
+    BOOST_CHECK_GT(directory, 0U);
+    BOOST_CHECK_GT(directoryAfter, directory);
+    BOOST_CHECK(after.compare(0, directory, before, 0, directory) == 0);
+    BOOST_CHECK_EQUAL(entriesAfter.size(), entriesBefore.size() + 1);
+    for(size_t i = 0; i < min(entriesBefore.size(), entriesAfter.size()); ++i)
+    {
+        BOOST_CHECK_EQUAL(entriesAfter[i].name, entriesBefore[i].name);
+        BOOST_CHECK_EQUAL(entriesAfter[i].offset, entriesBefore[i].offset);
+        BOOST_CHECK_EQUAL(entriesAfter[i].crc, entriesBefore[i].crc);
+    }
+    if(!entriesAfter.empty())
+        BOOST_CHECK_EQUAL(entriesAfter.back().offset, directory);
+
+    d = Container::openPtr(Doc::EXT + "-append.tmp");
+    BOOST_CHECK_EQUAL(d->signatures().size(), 2U);
+    if(d->signatures().size() == 2)
+    {
+        BOOST_CHECK_EQUAL(d->signatures().at(0)->signingCertificate(), signer1->cert());
+        BOOST_CHECK_EQUAL(d->signatures().at(1)->signingCertificate(), signer2->cert());
+    }
+    for(const Signature *s: d->signatures())
+        BOOST_CHECK_NO_THROW(s->validate());
+    BOOST_CHECK_EQUAL(d->dataFiles().size(), 1U);
+    if(!d->dataFiles().empty())
+    {
+        const DataFile *data = d->dataFiles().front();
+        BOOST_CHECK_EQUAL(data->fileName(), "test1.txt");
+        BOOST_CHECK_EQUAL(data->calcDigest("http://www.w3.org/2001/04/xmlenc#sha256"), vector<unsigned char>({
+            0xA8, 0x83, 0xDA, 0xFC, 0x48, 0x0D, 0x46, 0x6E, 0xE0, 0x4E,
+            0x0D, 0x6D, 0xA9, 0x86, 0xBD, 0x78, 0xEB, 0x1F, 0xDD, 0x21,
+            0x78, 0xD0, 0x46, 0x93, 0x72, 0x3D, 0xA3, 0xA8, 0xF9, 0x5D,
+            0x42, 0xF4 }));
+    }
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(parallelCompression, Doc, DocTypes)
+{
+    vector<unsigned char> data(3 * 1024 * 1024);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (unsigned char)((i * 7919) >> 5 ^ i % 251);
+    {
+        ofstream f("large.bin.tmp", ofstream::binary);
+        f.write((const char*)data.data(), streamsize(data.size()));
+    }
+    Digest digest(URI_SHA256);
+    digest.update(data);
+
+    // Data file larger than two deflate blocks is compressed on several threads
+    TestConfig *conf = dynamic_cast<TestConfig*>(Conf::instance());
+    BOOST_REQUIRE(conf);
+    conf->threads = 4;
+    unique_ptr<Container> d = Container::createPtr(Doc::EXT + "-parallel.tmp");
+    BOOST_CHECK_NO_THROW(d->addDataFile("large.bin.tmp", "application/octet-stream"));
+    unique_ptr<Signer> signer1(new PKCS12Signer("signer1.p12", "signer1"));
+    BOOST_CHECK_NO_THROW(d->sign(signer1.get()));
+    BOOST_CHECK_NO_THROW(d->save());
+    conf->threads = 0;
+
+    d = Container::openPtr(Doc::EXT + "-parallel.tmp");
+    BOOST_REQUIRE_EQUAL(d->dataFiles().size(), 1U);
+    const DataFile *file = d->dataFiles().front();
+    stringstream s;
+    file->saveAs(s);
+    BOOST_CHECK(s.str() == string(data.cbegin(), data.cend()));
+    BOOST_CHECK_EQUAL(file->calcDigest(URI_SHA256), digest.result());
+    for(const Signature *signature: d->signatures())
+        BOOST_CHECK_NO_THROW(signature->validate());
+}
+
 BOOST_AUTO_TEST_CASE_TEMPLATE(files, Doc, DocTypes)
 {
     unique_ptr<Signer> signer1(new PKCS12Signer("signer1.p12", "signer1"));
@@ -463,6 +1051,13 @@ BOOST_AUTO_TEST_CASE(XmlConfCase) {
     BOOST_CHECK_EQUAL(c.PKCS12Disable(), true);
     BOOST_CHECK_EQUAL(c.ocsp("ESTEID-SK 2007"), "http://ocsp.sk.ee");
 }
+
+BOOST_AUTO_TEST_CASE(XmlConfV5Case) {
+    XmlConfCurrent c("digidocpp.conf", util::File::path(DIGIDOCPPCONF, "/conf.xsd"));
+    BOOST_CHECK_EQUAL(c.zipCompressionLevel(), 9);
+    BOOST_CHECK_EQUAL(c.zipThreads(), 4);
+    BOOST_CHECK_EQUAL(c.TSLRefreshInterval(), 3600);
+}
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(FileUtilSuite)
@@ -497,6 +1092,170 @@ BOOST_AUTO_TEST_CASE(FromUriPathPreservesTrailingPercentageSign)
 }
 BOOST_AUTO_TEST_SUITE_END()
 
+BOOST_AUTO_TEST_SUITE(DigestSuite)
+BOOST_AUTO_TEST_CASE(MultiDigestEqualsDigest)
+{
+    vector<unsigned char> data(100000);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = (unsigned char)(i % 251);
+    set<string> uris = { URI_SHA1, URI_SHA224, URI_SHA256, URI_SHA384, URI_SHA512 };
+
+    // Uneven chunks, single pass feeds all algorithms
+    MultiDigest multi(uris);
+    for(size_t pos = 0; pos < data.size(); pos += 777)
+        multi.update(data.data() + pos, min<size_t>(777, data.size() - pos));
+    map<string,vector<unsigned char>> result = multi.result();
+    BOOST_CHECK_EQUAL(result.size(), uris.size());
+
+    {
+        ofstream f("digest.bin.tmp", ofstream::binary);
+        f.write((const char*)data.data(), streamsize(data.size()));
+    }
+    unique_ptr<Container> d = Container::createPtr("digest.asice.tmp");
+    d->addDataFile("digest.bin.tmp", "application/octet-stream");
+    const DataFile *file = d->dataFiles().front();
+    for(const string &uri: uris)
+    {
+        Digest digest(uri);
+        digest.update(data);
+        vector<unsigned char> expected = digest.result();
+        BOOST_CHECK_EQUAL(result[uri], expected);
+        BOOST_CHECK_EQUAL(file->calcDigest(uri), expected);
+    }
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(ThreadPoolSuite)
+BOOST_AUTO_TEST_CASE(StopFromTask)
+{
+    // Pool thread can not join itself, stop is ignored and pool keeps running
+    BOOST_CHECK_NO_THROW(util::ThreadPool::run([] { util::ThreadPool::stop(); }).get());
+    BOOST_CHECK_EQUAL(util::ThreadPool::run([] { return 1; }).get(), 1);
+    util::ThreadPool::stop();
+    BOOST_CHECK_EQUAL(util::ThreadPool::run([] { return 2; }).get(), 2);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(ZipSerializeSuite)
+BOOST_AUTO_TEST_CASE(Index)
+{
+    ZipSerialize::Properties prop = { "", util::date::gmtime(time(nullptr)), 0 };
+    {
+        ZipSerialize z("index.zip.tmp", true);
+        for(unsigned int i = 0; i < 100; ++i)
+        {
+            prop.comment = "comment" + to_string(i);
+            stringstream data(string(i, 'a'));
+            z.addFile("file" + to_string(i), data, prop);
+        }
+    }
+
+    ZipSerialize z("index.zip.tmp", false);
+    vector<string> list = z.list();
+    BOOST_CHECK_EQUAL(list.size(), 100U);
+    for(unsigned int i = 0; i < min<size_t>(list.size(), 100); ++i)
+        BOOST_CHECK_EQUAL(list[i], "file" + to_string(i));
+    // Lookups in reverse order are served from the index
+    for(unsigned int i = 100; i-- > 0;)
+    {
+        ZipSerialize::Properties p = z.properties("file" + to_string(i));
+        BOOST_CHECK_EQUAL(p.comment, "comment" + to_string(i));
+        BOOST_CHECK_EQUAL(p.size, i);
+        stringstream data;
+        z.extract("file" + to_string(i), data);
+        BOOST_CHECK_EQUAL(data.str(), string(i, 'a'));
+    }
+    BOOST_CHECK_THROW(z.properties("missing"), Exception);
+    stringstream data;
+    BOOST_CHECK_THROW(z.extract("missing", data), Exception);
+}
+
+BOOST_AUTO_TEST_CASE(RawCopy)
+{
+    string a(300000, 0);
+    for(size_t i = 0; i < a.size(); ++i)
+        a[i] = char(i % 251);
+    ZipSerialize::Properties prop = { "", util::date::gmtime(time(nullptr)), 0 };
+    {
+        ZipSerialize z("raw.zip.tmp", true);
+        stringstream mimetype(ASiCE::TYPE), data(a);
+        z.addFile("mimetype", mimetype, prop, ZipSerialize::DontCompress);
+        z.addFile("a", data, prop);
+    }
+    {
+        ZipSerialize source("raw.zip.tmp", false);
+        ZipSerialize z("raw-copy.zip.tmp", true);
+        z.addFile("mimetype", *source.stream("mimetype"), prop, ZipSerialize::DontCompress);
+        z.addFile("a", *source.stream("a"), prop);
+        z.addFile("b", *source.stream("a"), prop, ZipSerialize::DontCompress);
+    }
+
+    size_t directory = 0;
+    string copy = fileContent("raw-copy.zip.tmp");
+    vector<ZipEntry> entries = zipEntries(fileContent("raw.zip.tmp"), directory);
+    vector<ZipEntry> copied = zipEntries(copy, directory);
+    BOOST_REQUIRE_EQUAL(entries.size(), 2U);
+    BOOST_REQUIRE_EQUAL(copied.size(), 3U);
+    // mimetype stays first and stored, readable at fixed offset
+    BOOST_CHECK_EQUAL(copied[0].name, "mimetype");
+    BOOST_CHECK_EQUAL(copied[0].method, 0U);
+    BOOST_CHECK_EQUAL(copied[0].offset, 0U);
+    BOOST_CHECK_EQUAL(copied[0].crc, entries[0].crc);
+    BOOST_CHECK_EQUAL(copy.substr(30, 8), "mimetype");
+    BOOST_CHECK_EQUAL(copy.substr(38, ASiCE::TYPE.size()), ASiCE::TYPE);
+    // Compressed entry keeps compression method and CRC
+    BOOST_CHECK_EQUAL(copied[1].name, "a");
+    BOOST_CHECK_EQUAL(copied[1].method, entries[1].method);
+    BOOST_CHECK_EQUAL(copied[1].method, 8U);
+    BOOST_CHECK_EQUAL(copied[1].crc, entries[1].crc);
+    // DontCompress is not ignored for compressed entry, it is inflated and stored
+    BOOST_CHECK_EQUAL(copied[2].name, "b");
+    BOOST_CHECK_EQUAL(copied[2].method, 0U);
+    BOOST_CHECK_EQUAL(copied[2].crc, entries[1].crc);
+
+    ZipSerialize z("raw-copy.zip.tmp", false);
+    for(const string &file: {"a", "b"})
+    {
+        stringstream data;
+        z.extract(file, data);
+        BOOST_CHECK(data.str() == a);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(InterleavedStreams)
+{
+    string a(300000, 0), b(300000, 0);
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        a[i] = char(i % 251);
+        b[i] = char(i % 13);
+    }
+    ZipSerialize::Properties prop = { "", util::date::gmtime(time(nullptr)), 0 };
+    {
+        ZipSerialize z("interleaved.zip.tmp", true);
+        stringstream sa(a), sb(b);
+        z.addFile("a", sa, prop);
+        z.addFile("b", sb, prop);
+    }
+
+    // Each stream keeps its own inflate state, reading one must not restart the other
+    ZipSerialize z("interleaved.zip.tmp", false);
+    unique_ptr<istream> ia = z.stream("a"), ib = z.stream("b");
+    string ra, rb;
+    char buf[1000];
+    while(ia->read(buf, sizeof(buf)) || ia->gcount())
+    {
+        ra.append(buf, size_t(ia->gcount()));
+        ib->read(buf, sizeof(buf));
+        rb.append(buf, size_t(ib->gcount()));
+        if(ra.size() == 100000)
+            z.close();
+    }
+    BOOST_CHECK(ra == a);
+    BOOST_CHECK(rb == b);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_AUTO_TEST_SUITE(ASiCSTestSuite)
 BOOST_AUTO_TEST_CASE(OpenValidASiCSContainer)
 {
@@ -584,3 +1343,31 @@ BOOST_AUTO_TEST_CASE(OpenInvalidMimetypeContainer)
     BOOST_CHECK_THROW(Container::openPtr("test-invalid.asics"), Exception);
 }
 BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(ConnectSuite)
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(KeepAlive)
+{
+    signal(SIGPIPE, SIG_IGN);
+    HTTPServer server(2);
+    string url = "http://127.0.0.1:" + to_string(server.port) + "/";
+    Connect::Result r = Connect(url, "GET").exec();
+    BOOST_CHECK(r.isOK());
+    BOOST_CHECK_EQUAL(r.content, "1");
+    r = Connect(url, "GET").exec();
+    BOOST_CHECK(r.isOK());
+    BOOST_CHECK_EQUAL(r.content, "2");
+    BOOST_CHECK_EQUAL(server.connections.load(), 1);
+
+    // Server closes pooled connection when third request arrives, POST is resent on new connection
+    r = Connect(url, "POST").exec({{"Content-Type", "text/plain"}}, vector<unsigned char>{'d', 'a', 't', 'a'});
+    BOOST_CHECK(r.isOK());
+    BOOST_CHECK_EQUAL(r.content, "3");
+    BOOST_CHECK_EQUAL(server.connections.load(), 2);
+    r = Connect(url, "POST").exec({{"Content-Type", "text/plain"}}, vector<unsigned char>{'d', 'a', 't', 'a'});
+    BOOST_CHECK_EQUAL(r.content, "4");
+    BOOST_CHECK_EQUAL(server.connections.load(), 2);
+    Connect::clearPool();
+}
+#endif
+BOOST_AUTO_TEST_SUITE_END()
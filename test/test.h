@@ -109,8 +109,10 @@ public:
 	bool TSLOnlineDigest() const override { return false; }
 	string TSLUrl() const override { return path + "/TSL.xml"; }
 	vector<X509Cert> TSLCerts() const override { return { X509Cert(path + "/TSL.crt", X509Cert::Pem) }; }
+	int zipThreads() const override { return threads; }
 
 	string path = ".";
+	int threads = 0;
 };
 DIGIDOCPP_WARNING_POP
 